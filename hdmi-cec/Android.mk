@@ -59,12 +59,110 @@ LOCAL_SHARED_LIBRARIES := \
 
 LOCAL_SRC_FILES += \
 	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
 	sunxi_hdmi_cec_test.c
 
-LOCAL_CFLAGS += -Wno-unused-parameter -Wall
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -DLOG_LEVEL=LOG_LEVEL_VERBOSE -DSUNXI_HDMI_CEC_FAKE
 
 include $(BUILD_EXECUTABLE)
 
+# Host build runs against the fake transport: HDMI_CEC_TRANSPORT=fake
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.test
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES += \
+	hardware/libhardware/include
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
+	sunxi_hdmi_cec_test.c
+
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -DLOG_LEVEL=LOG_LEVEL_VERBOSE -DSUNXI_HDMI_CEC_FAKE
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SHARED_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog \
+    libdl \
+    libhardware
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
+	sunxi_hdmi_cec_bench.c
+
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -O2 -DSUNXI_HDMI_CEC_FAKE
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES += \
+	hardware/libhardware/include
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
+	sunxi_hdmi_cec_bench.c
+
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -O2 -DSUNXI_HDMI_CEC_FAKE
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.replay
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SHARED_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog \
+    libdl \
+    libhardware
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
+	sunxi_hdmi_cec_replay.c
+
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -O2 -DSUNXI_HDMI_CEC_FAKE
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES += \
+	hardware/libhardware/include
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec.c \
+	sunxi_hdmi_cec_fake.c \
+	sunxi_hdmi_cec_replay.c
+
+LOCAL_CFLAGS += -Wno-unused-parameter -Wall -O2 -DSUNXI_HDMI_CEC_FAKE
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := hdmi_cec.dump
@@ -78,8 +176,59 @@ LOCAL_SHARED_LIBRARIES := \
     libhardware
 
 LOCAL_SRC_FILES += \
-	sunxi_hdmi_cec_dump.c
+	sunxi_hdmi_cec_dump.c \
+	sunxi_hdmi_cec_decode.c
 
 LOCAL_CFLAGS += -Wno-unused-parameter -Wall
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.tracedump
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec_tracedump.c
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.tracedump
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec_tracedump.c
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.analyze
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec_analyze.c \
+	sunxi_hdmi_cec_decode.c
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hdmi_cec.analyze
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES += \
+	sunxi_hdmi_cec_analyze.c \
+	sunxi_hdmi_cec_decode.c
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,60 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _ANDROID_
+#include <cutils/properties.h>
+#endif // _ANDROID_
+
+// Tunables are read from persist.cec.<name> properties on Android, the
+// prefix is kept short to fit the 31 character property key limit.
+// An HDMI_CEC_<NAME> environment variable takes precedence, so the same
+// knobs can be set for test binaries and host builds.
+#define CONFIG_PROPERTY_PREFIX "persist.cec."
+#define CONFIG_ENV_PREFIX "HDMI_CEC_"
+#define CONFIG_VALUE_MAX 92
+
+static inline const char *get_config_string(const char *name, char *value, const char *default_value) {
+    char key[64];
+    size_t prefix = strlen(CONFIG_ENV_PREFIX);
+
+    snprintf(key, sizeof(key), CONFIG_ENV_PREFIX "%s", name);
+    for (char *p = key + prefix; *p; p++) {
+        *p = *p == '.' ? '_' : toupper((unsigned char) *p);
+    }
+
+    const char *env = getenv(key);
+    if (env) {
+        snprintf(value, CONFIG_VALUE_MAX, "%s", env);
+        return value;
+    }
+
+#ifdef _ANDROID_
+    snprintf(key, sizeof(key), CONFIG_PROPERTY_PREFIX "%s", name);
+    property_get(key, value, default_value ? default_value : "");
+    if (value[0] || default_value) {
+        return value;
+    }
+    return NULL;
+#else // _ANDROID_
+    if (!default_value) {
+        return NULL;
+    }
+    snprintf(value, CONFIG_VALUE_MAX, "%s", default_value);
+    return value;
+#endif // _ANDROID_
+}
+
+static inline int get_config_int(const char *name, int default_value) {
+    char value[CONFIG_VALUE_MAX];
+    if (!get_config_string(name, value, NULL) || !value[0]) {
+        return default_value;
+    }
+    return (int) strtol(value, NULL, 0);
+}
+
+#endif // __CONFIG_H__
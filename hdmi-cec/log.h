@@ -1,23 +1,39 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#define LOG_LEVEL_VERBOSE 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_INFO 4
+#define LOG_LEVEL_WARN 5
+#define LOG_LEVEL_ERROR 6
+
+// Messages below LOG_LEVEL are compiled out, the arguments are still
+// type-checked. Pass -DLOG_LEVEL=LOG_LEVEL_VERBOSE to get ALOGV back.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
 #ifdef _ANDROID_
 #include <android/log.h>
 
-#define ALOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define ALOGV(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define ALOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define ALOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
-#define ALOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOG_PRINT(level, ...) __android_log_print( \
+    (level) == LOG_LEVEL_VERBOSE ? ANDROID_LOG_INFO : (level), LOG_TAG, __VA_ARGS__)
 #else // _ANDROID_
 #include <stdio.h>
 
-#define ALOG(fmt, ...) fprintf(stderr, "%s: " fmt "\n", LOG_TAG, ##__VA_ARGS__)
-#define ALOGD ALOG
-#define ALOGV ALOG
-#define ALOGI ALOG
-#define ALOGW ALOG
-#define ALOGE ALOG
+#define LOG_PRINT(level, fmt, ...) fprintf(stderr, "%s: " fmt "\n", LOG_TAG, ##__VA_ARGS__)
 #endif // _ANDROID_
 
+#define ALOG(level, ...) do { \
+    if ((level) >= LOG_LEVEL) { \
+        LOG_PRINT(level, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define ALOGV(...) ALOG(LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#define ALOGD(...) ALOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define ALOGI(...) ALOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define ALOGW(...) ALOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define ALOGE(...) ALOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
 #endif // __LOG_H__
@@ -29,16 +29,32 @@
 
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <memory.h>
+#include <stdio.h>
 #include <errno.h>
+#include <linux/cec.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
 #include "log.h"
+#include "config.h"
+#include "sunxi_hdmi_cec.h"
+#include "sunxi_hdmi_cec_capture.h"
+#include "sunxi_hdmi_cec_trace.h"
+#include "sunxi_hdmi_cec_transport.h"
 
 #define HDMICEC_IOC_MAGIC  'H'
 #define HDMICEC_IOC_SETLOGICALADDRESS _IOW(HDMICEC_IOC_MAGIC,  1, unsigned char)
@@ -50,159 +66,2526 @@
 #define CEC_SUNXI_PATH "/dev/sunxi_hdmi_cec"
 #define CEC_VENDOR_PULSE_EIGHT 0x001582
 #define CEC_VERSION_1_4 0x05
+#define CEC_POWER_ON 0x00
+#define CEC_POWER_STANDBY 0x01
+#define CEC_OSD_NAME_MAX_LENGTH 14
+#define CEC_DEFAULT_OSD_NAME "Pine64"
+#define CEC_USER_CONTROL_TIMEOUT_MS 550 // a held key is repeated at least this often
+#define CEC_HOTPLUG_DEBOUNCE_MS 500
+#define CEC_DEVICE_RETRY_MS 100 // first wait before a device that failed is watched again
+#define CEC_DEVICE_RETRY_MAX_MS 5000
+#define CEC_UINPUT_PATH "/dev/uinput"
+#define CEC_UINPUT_NAME "sunxi-hdmi-cec"
+
+#define OPCODE_DIRECTED                 (1 << 0)
+#define OPCODE_BROADCAST                (1 << 1)
+
+#define TX_QUEUE_SIZE 16
+#define RX_RING_SIZE 64 // power of two
+#define TRACE_RING_SIZE 1024 // power of two
+#define HISTOGRAM_BUCKETS 24 // log2 microseconds, the last one collects everything above 4s
+#define DEDUP_TABLE_SIZE 64 // power of two
+#define DEDUP_DEFAULT_WINDOW_MS 500
+#define TOPOLOGY_DEFAULT_TTL_MS 2000
+#define TOPOLOGY_REPLY_QUEUE_SIZE 16
+
+// Signal free time, in nominal 2.4ms bit periods, as defined by CEC 1.4 section 9
+#define CEC_BIT_PERIOD_NS               2400000LL
+#define CEC_SFT_RETRANSMIT              3
+#define CEC_SFT_NEW_INITIATOR           5
+#define CEC_SFT_NEXT_FRAME              7
+#define CEC_MAX_RETRANSMIT              5
+
+#define PROCESS_WAKE_SHUTDOWN           (1 << 0)
+#define PROCESS_WAKE_RECONFIGURE        (1 << 1)
+#define PROCESS_WAKE_TOPOLOGY           (1 << 2)
+#define PROCESS_WAKE_HOTPLUG            (1 << 3)
+
+typedef void (*tx_done_callback_t)(const cec_message_t *msg, int result, void *arg);
+
+// Polling messages answer logical address allocation, directed messages
+// are mostly replies to the TV, broadcasts can wait the longest.
+enum tx_priority {
+    TX_PRIORITY_POLL,
+    TX_PRIORITY_DIRECTED,
+    TX_PRIORITY_BROADCAST,
+    TX_PRIORITY_COUNT
+};
+
+typedef struct tx_request {
+    cec_message_t msg;
+    tx_done_callback_t done;
+    void *done_arg;
+} tx_request_t;
+
+typedef struct tx_wait {
+    int done;
+    int result;
+} tx_wait_t;
+
+typedef struct tx_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    pthread_t thread;
+    int running;
+    int stopping;
+    int head[TX_PRIORITY_COUNT];
+    int count[TX_PRIORITY_COUNT];
+    tx_request_t requests[TX_PRIORITY_COUNT][TX_QUEUE_SIZE];
+} tx_queue_t;
+
+// Single producer (process_thread), single consumer (dispatch_thread).
+// The reader never blocks on the framework callback, if the dispatcher
+// falls behind new events are dropped and counted.
+typedef struct rx_ring {
+    hdmi_event_t events[RX_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    int waiting;
+    int stopping;
+    int event_fd;
+    unsigned int dispatched;
+    unsigned int overflows;
+    unsigned int high_water;
+    pthread_t thread;
+    int running;
+} rx_ring_t;
+
+typedef struct opcode_handler {
+    int (*handler)(struct hdmi_cec_device *dev, int initiator, int destination,
+                   const unsigned char *data, size_t length);
+    int flags;
+} opcode_handler_t;
+
+// Updated with relaxed atomics from any thread, read without stopping them
+typedef struct histogram {
+    unsigned int buckets[HISTOGRAM_BUCKETS];
+    unsigned int count;
+    unsigned int max_us;
+    uint64_t total_us;
+} histogram_t;
+
+// A frame delivered to the framework, identical frames within the
+// opcode window are suppressed
+typedef struct dedup_entry {
+    int64_t delivered_ns;
+    size_t length;
+    unsigned char frame[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
+} dedup_entry_t;
+
+// Reports kept for every device on the bus, in the order discovery asks for them
+enum topology_report_index {
+    TOPOLOGY_PHYSICAL_ADDRESS,
+    TOPOLOGY_VENDOR_ID,
+    TOPOLOGY_OSD_NAME,
+    TOPOLOGY_CEC_VERSION,
+    TOPOLOGY_POWER_STATUS,
+    TOPOLOGY_REPORT_COUNT
+};
+
+typedef struct topology_query {
+    int request;
+    int report;
+    size_t min_length;
+    int cached; // repeated requests are answered from the cache
+} topology_query_t;
+
+// A report as the device sent it, replayed to the framework when cached
+typedef struct topology_report {
+    int64_t received_ns; // 0 until the device reported it
+    int destination;
+    size_t length;
+    unsigned char body[CEC_MESSAGE_BODY_MAX_LENGTH];
+} topology_report_t;
+
+typedef struct topology_entry {
+    int present; // -1 unknown, 0 a poll was not acknowledged, 1 acknowledged or talked
+    int64_t present_ns;
+    topology_report_t reports[TOPOLOGY_REPORT_COUNT];
+} topology_entry_t;
+
+typedef struct metrics {
+    unsigned int rx_opcodes[256];
+    unsigned int rx_suppressed[256];
+    unsigned int tx_opcodes[256];
+    unsigned int tx_dropped[256]; // automatic replies the TX queue had no room for
+    unsigned int rx_events;
+    unsigned int rx_polls;
+    unsigned int tx_polls;
+    unsigned int tx_results[HDMI_RESULT_FAIL + 1];
+    unsigned int read_errors;
+    unsigned int hotplug_connects;
+    unsigned int hotplug_disconnects;
+    unsigned int hotplug_bounces;
+    unsigned int topology_poll_hits;
+    unsigned int topology_query_hits;
+    unsigned int discovery_frames;
+    histogram_t callback_time;
+    histogram_t write_time;
+    histogram_t read_latency;
+    histogram_t key_latency;
+} metrics_t;
+
+typedef struct tx_retry_policy {
+    int busy_retries;
+    int nack_retries;
+    int signal_free_time;
+} tx_retry_policy_t;
+
+// One per opened adapter, shared by every open of the module. The HAL
+// entry points cast the device back, the worker threads get the context.
+// The TX queue, RX ring and diagnostics stay process wide.
+typedef struct hdmi_cec_context {
+    hdmi_cec_device_t device; // must be first
+    int refcount; // guarded by context_lock
+    pthread_mutex_t lock; // serializes binder threads changing addresses or the callback
+    cec_transport_t transport;
+    // flags are written by binder threads and read by the workers, always with atomics
+    int enabled;
+    int system_control;
+    int logical_address;
+    int logical_address_mask;
+    int driver_logical_address; // under lock
+    int cached_physical_address;
+    hdmi_port_info_t port_info; // physical_address follows the cache, with atomics
+    // seqlock, odd while register_event_callback is changing the pair
+    uint32_t callback_sequence;
+    event_callback_t callback_func;
+    void *callback_arg;
+    pthread_t process_thread;
+    int process_epoll_fd;
+    int process_event_fd;
+    int process_wake_reasons;
+    // process_thread only
+    int64_t rx_timestamp_ns; // when the device saw the event being handled
+    int capture_fd;
+    int trace_trigger_fd; // inotify watch of the trace_trigger directory
+    char trace_trigger_name[CONFIG_VALUE_MAX];
+    int uinput_fd;
+    int key_timer_fd;
+    int pressed_key;
+    int device_timer_fd;
+    int device_retry_ms; // backoff after the last device error, 0 once the device read fine
+    int hotplug_timer_fd;
+    int hotplug_debounce_ms;
+    int hotplug_pending; // timer armed
+    int hotplug_input; // last state seen on the link
+    int hotplug_committed; // last state that held for the debounce time, -1 before the first one
+    int hotplug_reported; // last state given to the framework, -1 before the first one
+    // debounced link state returned by is_connected, written by process_thread
+    int connected;
+} hdmi_cec_context_t;
+
+// guards opening and closing, so every open of the module shares one context
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+static hdmi_cec_context_t *context = NULL;
+static tx_queue_t tx_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+static tx_retry_policy_t tx_retry_policy = {
+    .busy_retries = 2,
+    .nack_retries = 1,
+    .signal_free_time = 1,
+};
+static rx_ring_t rx_ring = {
+    .event_fd = -1,
+};
+static unsigned char opcode_enabled[256];
+static unsigned int opcode_responses[256];
+static char osd_name[CONFIG_VALUE_MAX] = CEC_DEFAULT_OSD_NAME;
+static unsigned short dedup_window_ms[256];
+static unsigned short keymap[256];
+static dedup_entry_t dedup_table[DEDUP_TABLE_SIZE]; // process_thread only
+static metrics_t metrics;
+// power status changes too often to be answered from the cache
+static const topology_query_t topology_queries[TOPOLOGY_REPORT_COUNT] = {
+    [TOPOLOGY_PHYSICAL_ADDRESS] = {CEC_MESSAGE_GIVE_PHYSICAL_ADDRESS, CEC_MESSAGE_REPORT_PHYSICAL_ADDRESS, 4, 1},
+    [TOPOLOGY_VENDOR_ID] = {CEC_MESSAGE_GIVE_DEVICE_VENDOR_ID, CEC_MESSAGE_DEVICE_VENDOR_ID, 4, 1},
+    [TOPOLOGY_OSD_NAME] = {CEC_MESSAGE_GIVE_OSD_NAME, CEC_MESSAGE_SET_OSD_NAME, 2, 1},
+    [TOPOLOGY_CEC_VERSION] = {CEC_MESSAGE_GET_CEC_VERSION, CEC_MESSAGE_CEC_VERSION, 2, 1},
+    [TOPOLOGY_POWER_STATUS] = {CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS, CEC_MESSAGE_REPORT_POWER_STATUS, 2, 0},
+};
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+static topology_entry_t topology[CEC_ADDR_BROADCAST]; // under topology_lock
+static cec_message_t topology_replies[TOPOLOGY_REPLY_QUEUE_SIZE]; // under topology_lock, for process_thread
+static int topology_reply_count = 0;
+static int topology_ttl_ms = TOPOLOGY_DEFAULT_TTL_MS;
+static int discovery_enabled = 1;
+static int discovery_running = 0; // under topology_lock, a discovery frame is queued or on the bus
+static int discovery_next_address = CEC_ADDR_BROADCAST; // under topology_lock, the next one to poll
+static int tx_async = 0; // async_tx, see send_message
+static cec_trace_record_t trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_sequence = 0;
+static int trace_enabled = 1;
+static int64_t last_bus_activity_ns = 0;
+static int last_bus_activity_tx = 0;
+
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// one shot timerfd, 0 disarms it
+static void arm_timer(int timer_fd, int timeout_ms) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static int sunxi_result(int ret) {
+    return ret < 0 ? -errno : 0;
+}
+
+static int sunxi_open(cec_transport_t *transport) {
+    transport->fd = open(CEC_SUNXI_PATH, O_RDWR | O_CLOEXEC);
+    return transport->fd < 0 ? -errno : 0;
+}
+
+static void sunxi_close(cec_transport_t *transport) {
+    close(transport->fd);
+    transport->fd = -1;
+}
+
+static int sunxi_read_event(cec_transport_t *transport, hdmi_cec_event_t *event, int64_t *timestamp_ns) {
+    int ret = read(transport->fd, event, sizeof(*event));
+    if (ret < 0) {
+        return -errno;
+    } else if (ret == 0) {
+        return -EIO;
+    }
+    *timestamp_ns = 0;
+    return 0;
+}
+
+static int sunxi_write_frame(cec_transport_t *transport, const unsigned char *frame, size_t length) {
+    return sunxi_result(write(transport->fd, frame, length));
+}
+
+static int sunxi_set_logical_address(cec_transport_t *transport, int addr) {
+    return sunxi_result(ioctl(transport->fd, HDMICEC_IOC_SETLOGICALADDRESS, addr));
+}
+
+static int sunxi_get_physical_address(cec_transport_t *transport, uint16_t *addr) {
+    uint32_t addr32 = 0;
+    int ret = ioctl(transport->fd, HDMICEC_IOC_GETPHYADDRESS, &addr32);
+    if (ret < 0) {
+        return -errno;
+    }
+    *addr = addr32;
+    return 0;
+}
+
+static int sunxi_start(cec_transport_t *transport) {
+    return sunxi_result(ioctl(transport->fd, HDMICEC_IOC_STARTDEVICE, NULL));
+}
+
+static int sunxi_stop(cec_transport_t *transport) {
+    return sunxi_result(ioctl(transport->fd, HDMICEC_IOC_STOPDEVICE, NULL));
+}
+
+static int sunxi_set_wakeup(cec_transport_t *transport, int enabled) {
+    return sunxi_result(ioctl(transport->fd, HDMICEC_IOC_SETWAKEUP, (unsigned char) enabled));
+}
+
+const cec_transport_ops_t sunxi_cec_transport_ops = {
+    .name = "sunxi",
+    .open = sunxi_open,
+    .close = sunxi_close,
+    .read_event = sunxi_read_event,
+    .write_frame = sunxi_write_frame,
+    .set_logical_address = sunxi_set_logical_address,
+    .get_physical_address = sunxi_get_physical_address,
+    .start = sunxi_start,
+    .stop = sunxi_stop,
+    .set_wakeup = sunxi_set_wakeup,
+};
+
+// Mainline kernels expose CEC adapters as /dev/cecN. Frames are sent with
+// a non-blocking CEC_TRANSMIT, its status comes back through CEC_RECEIVE
+// with the sequence number the kernel assigned, next to received frames.
+// The adapter retries and keeps the signal free time in hardware.
+//
+// transport->fd is an epoll set of the adapter and an eventfd for frames
+// the reader had to put aside while it was waiting on its own transmit.
+#define CEC_LINUX_DEFAULT_DEVICE "/dev/cec0"
+#define CEC_LINUX_TX_SLOTS 16
+#define CEC_LINUX_TX_TIMEOUT_MS 2000 // the kernel gives up after one second
+#define CEC_LINUX_CLAIM_TIMEOUT_MS 2000 // a claim polls a handful of addresses
+#define CEC_LINUX_CLAIM_POLL_MS 10
+#define CEC_LINUX_STASH_SIZE 16 // power of two
+
+typedef struct linux_tx_slot {
+    uint32_t sequence;
+    int done;
+    int result;
+} linux_tx_slot_t;
+
+typedef struct linux_cec {
+    int cec_fd;
+    int stash_fd;
+    uint32_t caps;
+    int physical_address;
+    int claimed;
+    unsigned int state_changes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    linux_tx_slot_t slots[CEC_LINUX_TX_SLOTS];
+    struct cec_msg stash[CEC_LINUX_STASH_SIZE];
+    unsigned int stash_head;
+    unsigned int stash_count;
+} linux_cec_t;
+
+static linux_cec_t linux_cec = {
+    .cec_fd = -1,
+    .stash_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// set on the thread calling read_event, which cannot wait for itself
+static __thread int linux_cec_reader;
+
+static int linux_tx_result(const struct cec_msg *msg) {
+    if (msg->tx_status & CEC_TX_STATUS_OK) {
+        return 0;
+    } else if (msg->tx_status & CEC_TX_STATUS_NACK) {
+        return -EIO;
+    } else if (msg->tx_status & CEC_TX_STATUS_ARB_LOST) {
+        return -EBUSY;
+    }
+    return -ECOMM;
+}
+
+static int linux_log_addr_type(int addr, uint8_t *prim_type, uint8_t *all_types) {
+    switch (addr) {
+        case CEC_ADDR_TV:
+            *prim_type = CEC_OP_PRIM_DEVTYPE_TV;
+            *all_types = CEC_OP_ALL_DEVTYPE_TV;
+            return CEC_LOG_ADDR_TYPE_TV;
+        case CEC_ADDR_RECORDER_1:
+        case CEC_ADDR_RECORDER_2:
+        case CEC_ADDR_RECORDER_3:
+            *prim_type = CEC_OP_PRIM_DEVTYPE_RECORD;
+            *all_types = CEC_OP_ALL_DEVTYPE_RECORD;
+            return CEC_LOG_ADDR_TYPE_RECORD;
+        case CEC_ADDR_TUNER_1:
+        case CEC_ADDR_TUNER_2:
+        case CEC_ADDR_TUNER_3:
+        case CEC_ADDR_TUNER_4:
+            *prim_type = CEC_OP_PRIM_DEVTYPE_TUNER;
+            *all_types = CEC_OP_ALL_DEVTYPE_TUNER;
+            return CEC_LOG_ADDR_TYPE_TUNER;
+        case CEC_ADDR_AUDIO_SYSTEM:
+            *prim_type = CEC_OP_PRIM_DEVTYPE_AUDIOSYSTEM;
+            *all_types = CEC_OP_ALL_DEVTYPE_AUDIOSYSTEM;
+            return CEC_LOG_ADDR_TYPE_AUDIOSYSTEM;
+        default:
+            *prim_type = CEC_OP_PRIM_DEVTYPE_PLAYBACK;
+            *all_types = CEC_OP_ALL_DEVTYPE_PLAYBACK;
+            return CEC_LOG_ADDR_TYPE_PLAYBACK;
+    }
+}
+
+static void linux_close(cec_transport_t *transport) {
+    linux_cec_t *cec = transport->priv;
+
+    if (transport->fd >= 0) {
+        close(transport->fd);
+        transport->fd = -1;
+    }
+    if (cec->stash_fd >= 0) {
+        close(cec->stash_fd);
+        cec->stash_fd = -1;
+    }
+    if (cec->cec_fd >= 0) {
+        close(cec->cec_fd);
+        cec->cec_fd = -1;
+    }
+    pthread_cond_destroy(&cec->cond);
+}
+
+static int linux_open(cec_transport_t *transport) {
+    linux_cec_t *cec = &linux_cec;
+    char path[CONFIG_VALUE_MAX];
+    get_config_string("device", path, CEC_LINUX_DEFAULT_DEVICE);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cec->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    memset(cec->slots, 0, sizeof(cec->slots));
+    cec->stash_head = cec->stash_count = 0;
+    cec->claimed = 0;
+    transport->priv = cec;
+    transport->fd = -1;
+
+    int ret = 0;
+    struct cec_caps caps;
+    cec->cec_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (cec->cec_fd < 0 || ioctl(cec->cec_fd, CEC_ADAP_G_CAPS, &caps) < 0) {
+        ret = -errno;
+        goto error;
+    }
+    if (!(caps.capabilities & CEC_CAP_TRANSMIT)) {
+        ret = -ENOTSUP;
+        goto error;
+    }
+    cec->caps = caps.capabilities;
+
+    // adapters without CEC_CAP_PHYS_ADDR get it from the HDMI driver
+    int physical_address = get_config_int("physical_address", -1);
+    if ((cec->caps & CEC_CAP_PHYS_ADDR) && physical_address >= 0) {
+        uint16_t value = physical_address;
+        if (ioctl(cec->cec_fd, CEC_ADAP_S_PHYS_ADDR, &value) < 0) {
+            ALOGW("linux_open: unable to set physical_address=%04x: %d", value, errno);
+        }
+    }
+
+    uint16_t address = CEC_PHYS_ADDR_INVALID;
+    ioctl(cec->cec_fd, CEC_ADAP_G_PHYS_ADDR, &address);
+    cec->physical_address = address;
+
+    cec->stash_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    transport->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (cec->stash_fd < 0 || transport->fd < 0) {
+        ret = -errno;
+        goto error;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = cec->cec_fd;
+    if (epoll_ctl(transport->fd, EPOLL_CTL_ADD, cec->cec_fd, &ev) < 0) {
+        ret = -errno;
+        goto error;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = cec->stash_fd;
+    if (epoll_ctl(transport->fd, EPOLL_CTL_ADD, cec->stash_fd, &ev) < 0) {
+        ret = -errno;
+        goto error;
+    }
+
+    ALOGI("linux_open: %s driver=%s name=%s caps=%x physical_address=%04x",
+          path, caps.driver, caps.name, caps.capabilities, address);
+    return 0;
+
+error:
+    linux_close(transport);
+    return ret;
+}
+
+static int linux_stash(linux_cec_t *cec, const struct cec_msg *msg) {
+    pthread_mutex_lock(&cec->lock);
+    if (cec->stash_count >= CEC_LINUX_STASH_SIZE) {
+        pthread_mutex_unlock(&cec->lock);
+        ALOGW("linux_stash: full, dropping %02x", msg->msg[0]);
+        return -ENOSPC;
+    }
+    cec->stash[(cec->stash_head + cec->stash_count) % CEC_LINUX_STASH_SIZE] = *msg;
+    cec->stash_count++;
+    pthread_mutex_unlock(&cec->lock);
+
+    uint64_t value = 1;
+    if (write(cec->stash_fd, &value, sizeof(value)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int linux_unstash(linux_cec_t *cec, struct cec_msg *msg) {
+    uint64_t value;
+    if (read(cec->stash_fd, &value, sizeof(value)) < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cec->lock);
+    int found = cec->stash_count > 0;
+    if (found) {
+        *msg = cec->stash[cec->stash_head];
+        cec->stash_head = (cec->stash_head + 1) % CEC_LINUX_STASH_SIZE;
+        cec->stash_count--;
+    }
+    pthread_mutex_unlock(&cec->lock);
+    return found;
+}
+
+static void linux_complete(linux_cec_t *cec, const struct cec_msg *msg) {
+    pthread_mutex_lock(&cec->lock);
+    for (int i = 0; i < CEC_LINUX_TX_SLOTS; i++) {
+        linux_tx_slot_t *slot = &cec->slots[i];
+        if (slot->sequence == msg->sequence && !slot->done) {
+            slot->result = linux_tx_result(msg);
+            slot->done = 1;
+            pthread_cond_broadcast(&cec->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cec->lock);
+}
+
+// Takes one message off the adapter, transmit results complete their slot.
+// Returns 1 for a received frame, 0 otherwise.
+static int linux_receive(linux_cec_t *cec, struct cec_msg *msg) {
+    memset(msg, 0, sizeof(*msg));
+    if (ioctl(cec->cec_fd, CEC_RECEIVE, msg) < 0) {
+        return errno == ENODEV ? -ENODEV : 0;
+    }
+    if (msg->sequence) {
+        linux_complete(cec, msg);
+        return 0;
+    }
+    return 1;
+}
+
+static int linux_read_event(cec_transport_t *transport, hdmi_cec_event_t *event, int64_t *timestamp_ns) {
+    linux_cec_t *cec = transport->priv;
+    linux_cec_reader = 1;
+
+    struct cec_msg msg;
+    int ret = linux_unstash(cec, &msg) ? 1 : linux_receive(cec, &msg);
+    if (ret < 0) {
+        return ret;
+    } else if (ret > 0) {
+        memset(event, 0, sizeof(*event));
+        event->event_type = MESSAGE_TYPE_RECEIVE_SUCCESS;
+        event->msg_len = msg.len;
+        memcpy(event->msg, msg.msg, msg.len);
+        *timestamp_ns = msg.rx_ts;
+        return 0;
+    }
+
+    struct cec_event ev;
+    if (ioctl(cec->cec_fd, CEC_DQEVENT, &ev) < 0) {
+        return errno == ENODEV ? -ENODEV : -EAGAIN;
+    }
+
+    if (ev.event == CEC_EVENT_LOST_MSGS) {
+        ALOGW("linux_read_event: kernel dropped %u messages", ev.lost_msgs.lost_msgs);
+        return -EAGAIN;
+    } else if (ev.event != CEC_EVENT_STATE_CHANGE) {
+        return -EAGAIN;
+    }
+
+    // state changes also report claimed logical addresses, only a
+    // physical address appearing or going away is a hotplug
+    pthread_mutex_lock(&cec->lock);
+    __atomic_store_n(&cec->claimed, (ev.state_change.log_addr_mask & 0x7fff) != 0, __ATOMIC_RELEASE);
+    cec->state_changes++;
+    pthread_cond_broadcast(&cec->cond);
+    pthread_mutex_unlock(&cec->lock);
+
+    int connected = ev.state_change.phys_addr != CEC_PHYS_ADDR_INVALID;
+    int was_connected = cec->physical_address != CEC_PHYS_ADDR_INVALID;
+    cec->physical_address = ev.state_change.phys_addr;
+    ALOGV("linux_read_event: state physical_address=%04x log_addr_mask=%04x",
+          ev.state_change.phys_addr, ev.state_change.log_addr_mask);
+    if (connected == was_connected) {
+        return -EAGAIN;
+    }
+
+    memset(event, 0, sizeof(*event));
+    event->event_type = connected ? MESSAGE_TYPE_CONNECTED : MESSAGE_TYPE_DISCONNECTED;
+    *timestamp_ns = ev.ts;
+    return 0;
+}
+
+static int linux_wait_result(linux_cec_t *cec, linux_tx_slot_t *slot) {
+    int64_t deadline = monotonic_ns() + CEC_LINUX_TX_TIMEOUT_MS * 1000000LL;
+    int ret = -ETIMEDOUT;
+
+    pthread_mutex_lock(&cec->lock);
+    while (!slot->done) {
+        int64_t now = monotonic_ns();
+        if (now >= deadline) {
+            break;
+        }
+
+        if (!linux_cec_reader) {
+            struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
+            pthread_cond_timedwait(&cec->cond, &cec->lock, &ts);
+            continue;
+        }
+
+        // nobody else reads the adapter while the reader waits here, received
+        // frames are put aside for read_event
+        pthread_mutex_unlock(&cec->lock);
+        struct pollfd pfd = {cec->cec_fd, POLLIN, 0};
+        if (poll(&pfd, 1, (deadline - now + 999999) / 1000000) > 0) {
+            struct cec_msg msg;
+            if (linux_receive(cec, &msg) > 0) {
+                linux_stash(cec, &msg);
+            }
+        }
+        pthread_mutex_lock(&cec->lock);
+    }
+    if (slot->done) {
+        ret = slot->result;
+    }
+    slot->sequence = 0;
+    pthread_mutex_unlock(&cec->lock);
+    return ret;
+}
+
+static int linux_write_frame(cec_transport_t *transport, const unsigned char *frame, size_t length) {
+    linux_cec_t *cec = transport->priv;
+
+    struct cec_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.len = length;
+    memcpy(msg.msg, frame, length);
+
+    // the kernel refuses to transmit before an address is claimed, except
+    // from the unregistered address, the initiator does not matter for a poll
+    if (length == 1 && !__atomic_load_n(&cec->claimed, __ATOMIC_ACQUIRE)) {
+        msg.msg[0] = (CEC_ADDR_UNREGISTERED << 4) | (frame[0] & 0x0f);
+    }
+
+    // the slot is claimed under the lock, so the reader cannot see the
+    // result before the sequence is recorded
+    pthread_mutex_lock(&cec->lock);
+    linux_tx_slot_t *slot = NULL;
+    for (int i = 0; i < CEC_LINUX_TX_SLOTS && !slot; i++) {
+        if (!cec->slots[i].sequence) {
+            slot = &cec->slots[i];
+        }
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&cec->lock);
+        return -EBUSY;
+    }
+    if (ioctl(cec->cec_fd, CEC_TRANSMIT, &msg) < 0) {
+        int ret = -errno;
+        pthread_mutex_unlock(&cec->lock);
+        return ret;
+    }
+    slot->sequence = msg.sequence;
+    slot->done = 0;
+    pthread_mutex_unlock(&cec->lock);
+
+    return linux_wait_result(cec, slot);
+}
+
+// The descriptor is non-blocking, so CEC_ADAP_S_LOG_ADDRS returns before
+// the kernel claimed anything. The end of the claim is a state change event,
+// the reader takes it off the adapter and wakes us up. On the reader itself
+// nobody does, the adapter is looked at every CEC_LINUX_CLAIM_POLL_MS.
+// Returns the claimed address, CEC_ADDR_UNREGISTERED if none was free.
+static int linux_wait_claim(linux_cec_t *cec) {
+    int64_t deadline = monotonic_ns() + CEC_LINUX_CLAIM_TIMEOUT_MS * 1000000LL;
+    struct cec_log_addrs log_addrs;
+
+    pthread_mutex_lock(&cec->lock);
+    for (;;) {
+        unsigned int changes = cec->state_changes;
+        if (ioctl(cec->cec_fd, CEC_ADAP_G_LOG_ADDRS, &log_addrs) < 0) {
+            int ret = -errno;
+            pthread_mutex_unlock(&cec->lock);
+            return ret;
+        }
+        // unknown until the adapter is configured
+        if (log_addrs.num_log_addrs && log_addrs.log_addr[0] != CEC_LOG_ADDR_INVALID) {
+            pthread_mutex_unlock(&cec->lock);
+            return log_addrs.log_addr[0];
+        }
+
+        while (changes == cec->state_changes) {
+            int64_t now = monotonic_ns();
+            if (now >= deadline) {
+                pthread_mutex_unlock(&cec->lock);
+                return -ETIMEDOUT;
+            }
+            int64_t wake = deadline;
+            if (linux_cec_reader && now + CEC_LINUX_CLAIM_POLL_MS * 1000000LL < deadline) {
+                wake = now + CEC_LINUX_CLAIM_POLL_MS * 1000000LL;
+            }
+            struct timespec ts = {wake / 1000000000LL, wake % 1000000000LL};
+            if (pthread_cond_timedwait(&cec->cond, &cec->lock, &ts) == ETIMEDOUT && linux_cec_reader) {
+                break;
+            }
+        }
+    }
+}
+
+static int linux_set_logical_address(cec_transport_t *transport, int addr) {
+    linux_cec_t *cec = transport->priv;
+    if (!(cec->caps & CEC_CAP_LOG_ADDRS)) {
+        // the kernel driver claims addresses on its own
+        return 0;
+    }
+
+    struct cec_log_addrs log_addrs;
+    memset(&log_addrs, 0, sizeof(log_addrs));
+    __atomic_store_n(&cec->claimed, 0, __ATOMIC_RELEASE);
+    if (ioctl(cec->cec_fd, CEC_ADAP_S_LOG_ADDRS, &log_addrs) < 0) {
+        return -errno;
+    }
+    if (addr == CEC_ADDR_UNREGISTERED) {
+        return 0;
+    }
+
+    // The kernel is given a device type, not an address, and polls the
+    // addresses of that type in order. The framework already polled for
+    // addr, so the first free one should be the same.
+    log_addrs.cec_version = CEC_OP_CEC_VERSION_1_4;
+    log_addrs.vendor_id = CEC_VENDOR_PULSE_EIGHT;
+    log_addrs.num_log_addrs = 1;
+    log_addrs.log_addr_type[0] = linux_log_addr_type(addr, &log_addrs.primary_device_type[0],
+                                                     &log_addrs.all_device_types[0]);
+    log_addrs.flags = CEC_LOG_ADDRS_FL_ALLOW_UNREG_FALLBACK;
+    memcpy(log_addrs.osd_name, osd_name, strnlen(osd_name, sizeof(log_addrs.osd_name) - 1));
+
+    uint16_t physical_address = CEC_PHYS_ADDR_INVALID;
+    ioctl(cec->cec_fd, CEC_ADAP_G_PHYS_ADDR, &physical_address);
+    if (ioctl(cec->cec_fd, CEC_ADAP_S_LOG_ADDRS, &log_addrs) < 0) {
+        return -errno;
+    }
+    if (physical_address == CEC_PHYS_ADDR_INVALID) {
+        // nothing is claimed without a TV, the kernel does it once one shows up
+        ALOGI("linux_set_logical_address: %d deferred until connected", addr);
+        return 0;
+    }
+
+    int claimed = linux_wait_claim(cec);
+    if (claimed == addr) {
+        __atomic_store_n(&cec->claimed, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    ALOGW("linux_set_logical_address: asked for %d, kernel claimed %d", addr, claimed);
+    memset(&log_addrs, 0, sizeof(log_addrs));
+    ioctl(cec->cec_fd, CEC_ADAP_S_LOG_ADDRS, &log_addrs);
+    return claimed < 0 ? claimed : -EADDRINUSE;
+}
+
+static int linux_get_physical_address(cec_transport_t *transport, uint16_t *addr) {
+    linux_cec_t *cec = transport->priv;
+    uint16_t address = CEC_PHYS_ADDR_INVALID;
+    if (ioctl(cec->cec_fd, CEC_ADAP_G_PHYS_ADDR, &address) < 0) {
+        return -errno;
+    } else if (address == CEC_PHYS_ADDR_INVALID) {
+        return -ENXIO;
+    }
+    *addr = address;
+    return 0;
+}
+
+static int linux_start(cec_transport_t *transport) {
+    linux_cec_t *cec = transport->priv;
+    // every message is passed through, the HAL and the framework answer them
+    uint32_t mode = CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER_PASSTHRU;
+    return sunxi_result(ioctl(cec->cec_fd, CEC_S_MODE, &mode));
+}
+
+static int linux_stop(cec_transport_t *transport) {
+    linux_cec_t *cec = transport->priv;
+    uint32_t mode = CEC_MODE_INITIATOR | CEC_MODE_NO_FOLLOWER;
+    return sunxi_result(ioctl(cec->cec_fd, CEC_S_MODE, &mode));
+}
+
+static int linux_set_wakeup(cec_transport_t *transport, int enabled) {
+    // the kernel CEC framework leaves wake up on CEC to the platform
+    return 0;
+}
+
+const cec_transport_ops_t linux_cec_transport_ops = {
+    .name = "linux",
+    .flags = CEC_TRANSPORT_RETRIES,
+    .open = linux_open,
+    .close = linux_close,
+    .read_event = linux_read_event,
+    .write_frame = linux_write_frame,
+    .set_logical_address = linux_set_logical_address,
+    .get_physical_address = linux_get_physical_address,
+    .start = linux_start,
+    .stop = linux_stop,
+    .set_wakeup = linux_set_wakeup,
+};
+
+static void get_vendor_id(const struct hdmi_cec_device *dev, uint32_t *vendor_id) {
+    *vendor_id = CEC_VENDOR_PULSE_EIGHT;
+}
+
+static hdmi_cec_context_t *context_of(const struct hdmi_cec_device *dev) {
+    return (hdmi_cec_context_t *) dev;
+}
+
+static void wake_process_thread(hdmi_cec_context_t *ctx, int reason);
+static void start_discovery(hdmi_cec_context_t *ctx);
+
+static void set_callback(hdmi_cec_context_t *ctx, event_callback_t callback, void *arg) {
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t sequence = ctx->callback_sequence;
+    __atomic_store_n(&ctx->callback_sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->callback_func, callback, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->callback_arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->callback_sequence, sequence + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Never blocks, a callback and arg from two registrations are never mixed
+static event_callback_t get_callback(hdmi_cec_context_t *ctx, void **arg) {
+    for (;;) {
+        uint32_t sequence = __atomic_load_n(&ctx->callback_sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+        event_callback_t callback = __atomic_load_n(&ctx->callback_func, __ATOMIC_RELAXED);
+        *arg = __atomic_load_n(&ctx->callback_arg, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ctx->callback_sequence, __ATOMIC_RELAXED) == sequence) {
+            return callback;
+        }
+    }
+}
+
+static int set_driver_logical_address(hdmi_cec_context_t *ctx, int addr) {
+    if (ctx->driver_logical_address == addr) {
+        return 0;
+    }
+    int ret = ctx->transport.ops->set_logical_address(&ctx->transport, addr);
+    if (ret == 0) {
+        ctx->driver_logical_address = addr;
+        return 0;
+    } else {
+        ALOGE("set_driver_logical_address: %d failed: %d", addr, ret);
+        return ret;
+    }
+}
+
+static int is_logical_address(hdmi_cec_context_t *ctx, int addr) {
+    if (addr < 0 || addr >= CEC_ADDR_BROADCAST) {
+        return 0;
+    }
+    return (__atomic_load_n(&ctx->logical_address_mask, __ATOMIC_ACQUIRE) >> addr) & 1;
+}
+
+// Every address in logical_address_mask is accepted and answered by the HAL,
+// but a frame sent to it is only acknowledged if the device was given it too.
+// The sunxi driver and the kernel framework as used here take a single
+// address, so further ones are refused unless the transport has
+// CEC_TRANSPORT_MULTI_ADDRESS.
+static int add_logical_address(const struct hdmi_cec_device *dev, cec_logical_address_t addr) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (addr < 0 || addr >= CEC_ADDR_BROADCAST) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (is_logical_address(ctx, addr)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+
+    int first = ctx->logical_address == CEC_DEVICE_INACTIVE;
+    if (!first && !(ctx->transport.ops->flags & CEC_TRANSPORT_MULTI_ADDRESS)) {
+        pthread_mutex_unlock(&ctx->lock);
+        ALOGW("add_logical_address: %d refused, %s only acknowledges %d",
+              addr, ctx->transport.ops->name, ctx->logical_address);
+        return -EADDRNOTAVAIL;
+    }
+
+    int ret = set_driver_logical_address(ctx, addr);
+    if (ret < 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        return ret;
+    }
+    if (first) {
+        __atomic_store_n(&ctx->logical_address, addr, __ATOMIC_RELEASE);
+    }
+
+    __atomic_fetch_or(&ctx->logical_address_mask, 1 << addr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->lock);
+    ALOGV("add_logical_address: %d mask=%04x", addr, ctx->logical_address_mask);
+
+    // the framework is about to look for the other devices
+    if (first) {
+        start_discovery(ctx);
+    }
+    return 0;
+}
+
+static void clear_logical_address(const struct hdmi_cec_device *dev) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+
+    pthread_mutex_lock(&ctx->lock);
+    __atomic_store_n(&ctx->logical_address_mask, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->logical_address, CEC_DEVICE_INACTIVE, __ATOMIC_RELEASE);
+    set_driver_logical_address(ctx, CEC_ADDR_UNREGISTERED);
+    pthread_mutex_unlock(&ctx->lock);
+    ALOGV("clear_logical_address");
+}
+
+static int refresh_physical_address(hdmi_cec_context_t *ctx) {
+    uint16_t address = 0;
+    int ret = ctx->transport.ops->get_physical_address(&ctx->transport, &address);
+    if (ret == 0) {
+        __atomic_store_n(&ctx->cached_physical_address, address, __ATOMIC_RELEASE);
+        __atomic_store_n(&ctx->port_info.physical_address, address, __ATOMIC_RELEASE);
+        ALOGV("refresh_physical_address: %d", address);
+        return 0;
+    } else {
+        __atomic_store_n(&ctx->cached_physical_address, -1, __ATOMIC_RELEASE);
+        ALOGE("refresh_physical_address: failed: %d", ret);
+        return ret;
+    }
+}
+
+static int get_physical_address(const struct hdmi_cec_device *dev, uint16_t *addr) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+
+    // refreshed on hotplug, see handle_cec_event
+    int address = __atomic_load_n(&ctx->cached_physical_address, __ATOMIC_ACQUIRE);
+    if (address < 0) {
+        int ret = refresh_physical_address(ctx);
+        if (ret < 0) {
+            return ret;
+        }
+        address = __atomic_load_n(&ctx->cached_physical_address, __ATOMIC_ACQUIRE);
+    }
+
+    *addr = address;
+    return 0;
+}
+
+// Multiple writers claim slots with a single fetch-and-add. The slot
+// sequence is cleared while the record is written, so the dump can tell
+// torn records apart from complete ones.
+static void trace_frame(int type, int result, int attempts, const unsigned char *frame, size_t length) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    uint32_t sequence = __atomic_add_fetch(&trace_sequence, 1, __ATOMIC_RELAXED);
+    cec_trace_record_t *record = &trace_ring[sequence % TRACE_RING_SIZE];
+
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (length > sizeof(record->data)) {
+        length = sizeof(record->data);
+    }
+    record->timestamp_ns = monotonic_ns();
+    record->type = type;
+    record->result = result;
+    record->attempts = attempts;
+    record->length = length;
+    if (length) {
+        memcpy(record->data, frame, length);
+    }
+
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+static void trace_message(int type, int result, int attempts, const cec_message_t *msg) {
+    unsigned char frame[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
+    frame[0] = (msg->initiator << 4) | (msg->destination & 0x0f);
+    memcpy(frame + 1, msg->body, msg->length);
+    trace_frame(type, result, attempts, frame, msg->length + 1);
+}
+
+static void histogram_add(histogram_t *histogram, int64_t elapsed_ns) {
+    unsigned int us = elapsed_ns > 0 ? (unsigned int) (elapsed_ns / 1000) : 0;
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_us, us, __ATOMIC_RELAXED);
+
+    unsigned int max_us = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (us > max_us &&
+           !__atomic_compare_exchange_n(&histogram->max_us, &max_us, us, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void count_message(unsigned int *opcodes, unsigned int *polls, const unsigned char *body, size_t length) {
+    if (length == 0) {
+        __atomic_fetch_add(polls, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&opcodes[body[0]], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void note_bus_activity(int transmitted, int64_t timestamp_ns) {
+    __atomic_store_n(&last_bus_activity_tx, transmitted, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_bus_activity_ns, timestamp_ns, __ATOMIC_RELEASE);
+}
+
+static void topology_reset(void) {
+    pthread_mutex_lock(&topology_lock);
+    memset(topology, 0, sizeof(topology));
+    for (int addr = 0; addr < CEC_ADDR_BROADCAST; addr++) {
+        topology[addr].present = -1;
+    }
+    topology_reply_count = 0;
+    pthread_mutex_unlock(&topology_lock);
+}
+
+static int topology_is_fresh(int64_t timestamp_ns, int64_t now) {
+    return timestamp_ns && now - timestamp_ns < topology_ttl_ms * 1000000LL;
+}
+
+static int find_topology_report(int opcode, int request) {
+    for (int index = 0; index < TOPOLOGY_REPORT_COUNT; index++) {
+        if ((request ? topology_queries[index].request : topology_queries[index].report) == opcode) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Called from process_thread for every received frame. Anybody talking is
+// on the bus, the reports are kept as they were sent.
+static void topology_observe(int initiator, int destination, const unsigned char *data, size_t length,
+                             int64_t timestamp_ns) {
+    if (initiator >= CEC_ADDR_BROADCAST) {
+        return;
+    }
+
+    pthread_mutex_lock(&topology_lock);
+    topology_entry_t *entry = &topology[initiator];
+    if (length == 0) {
+        if (initiator == destination) {
+            // somebody is allocating the address, whoever had it is gone
+            memset(entry, 0, sizeof(*entry));
+            entry->present = -1;
+        }
+        pthread_mutex_unlock(&topology_lock);
+        return;
+    }
+
+    entry->present = 1;
+    entry->present_ns = timestamp_ns;
+
+    int index = find_topology_report(data[0], 0);
+    if (index >= 0 && length >= topology_queries[index].min_length) {
+        topology_report_t *report = &entry->reports[index];
+        report->received_ns = timestamp_ns;
+        report->destination = destination;
+        report->length = length;
+        memcpy(report->body, data, length);
+    }
+    pthread_mutex_unlock(&topology_lock);
+}
+
+// Called with the final result of every frame sent to another device.
+// A NACK drops what is cached about the device, only a NACKed poll says
+// it is gone, any other frame could have been refused for lack of room.
+static void topology_transmitted(const cec_message_t *msg, int result) {
+    if (msg->destination >= CEC_ADDR_BROADCAST || msg->initiator == msg->destination) {
+        return;
+    }
+    if (result != HDMI_RESULT_SUCCESS && result != HDMI_RESULT_NACK) {
+        return;
+    }
+
+    pthread_mutex_lock(&topology_lock);
+    topology_entry_t *entry = &topology[msg->destination];
+    if (result == HDMI_RESULT_NACK) {
+        memset(entry->reports, 0, sizeof(entry->reports));
+        entry->present = msg->length ? -1 : 0;
+    } else {
+        entry->present = 1;
+    }
+    entry->present_ns = monotonic_ns();
+    pthread_mutex_unlock(&topology_lock);
+}
+
+// A poll of a device that acknowledged or ignored one within the TTL gets
+// the same result, -1 when the bus has to be asked. Logical address
+// allocation polls always go to the bus.
+static int topology_cached_poll(const cec_message_t *msg) {
+    if (msg->length || msg->destination >= CEC_ADDR_BROADCAST || msg->initiator == msg->destination) {
+        return -1;
+    }
+
+    int result = -1;
+    pthread_mutex_lock(&topology_lock);
+    topology_entry_t *entry = &topology[msg->destination];
+    if (entry->present >= 0 && topology_is_fresh(entry->present_ns, monotonic_ns())) {
+        result = entry->present ? HDMI_RESULT_SUCCESS : HDMI_RESULT_NACK;
+    }
+    pthread_mutex_unlock(&topology_lock);
+
+    if (result >= 0) {
+        __atomic_fetch_add(&metrics.topology_poll_hits, 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+static void wait_signal_free_time(int bit_periods) {
+    if (!tx_retry_policy.signal_free_time) {
+        return;
+    }
+
+    int64_t deadline = __atomic_load_n(&last_bus_activity_ns, __ATOMIC_ACQUIRE) +
+                       bit_periods * CEC_BIT_PERIOD_NS;
+    if (deadline <= monotonic_ns()) {
+        return;
+    }
+
+    struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void load_retry_policy(hdmi_cec_context_t *ctx) {
+    tx_retry_policy.busy_retries = get_config_int("tx_busy_retries", tx_retry_policy.busy_retries);
+    tx_retry_policy.nack_retries = get_config_int("tx_nack_retries", tx_retry_policy.nack_retries);
+    tx_retry_policy.signal_free_time = get_config_int("tx_signal_free_time", tx_retry_policy.signal_free_time);
+
+    if (tx_retry_policy.busy_retries > CEC_MAX_RETRANSMIT) {
+        tx_retry_policy.busy_retries = CEC_MAX_RETRANSMIT;
+    }
+    if (tx_retry_policy.nack_retries > CEC_MAX_RETRANSMIT) {
+        tx_retry_policy.nack_retries = CEC_MAX_RETRANSMIT;
+    }
+    if (ctx->transport.ops->flags & CEC_TRANSPORT_RETRIES) {
+        tx_retry_policy.signal_free_time = 0;
+    }
+}
+
+static void get_retry_limits(hdmi_cec_context_t *ctx, const cec_message_t *msg,
+                             int *busy_retries, int *nack_retries) {
+    *busy_retries = tx_retry_policy.busy_retries;
+    *nack_retries = tx_retry_policy.nack_retries;
+
+    if (ctx->transport.ops->flags & CEC_TRANSPORT_RETRIES) {
+        *busy_retries = 0;
+        *nack_retries = 0;
+        return;
+    }
+
+    if (msg->length == 0) {
+        // a NACKed poll means the address is free, this is the answer
+        *nack_retries = 0;
+        return;
+    }
+
+    switch (msg->body[0]) {
+        case CEC_MESSAGE_USER_CONTROL_PRESSED:
+        case CEC_MESSAGE_USER_CONTROL_RELEASED:
+            // a late key press is worse than a lost one, the remote repeats it anyway
+            *busy_retries = 1;
+            *nack_retries = 0;
+            break;
+
+        case CEC_MESSAGE_STANDBY:
+        case CEC_MESSAGE_ACTIVE_SOURCE:
+        case CEC_MESSAGE_INACTIVE_SOURCE:
+        case CEC_MESSAGE_IMAGE_VIEW_ON:
+        case CEC_MESSAGE_TEXT_VIEW_ON:
+            // state changes the TV has to see
+            *busy_retries = CEC_MAX_RETRANSMIT;
+            break;
+    }
+}
+
+static int transmit_attempt(hdmi_cec_context_t *ctx, const cec_message_t *msg) {
+    unsigned char message[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
+    message[0] = (msg->initiator << 4) | (msg->destination & 0x0f);
+    memcpy(message + 1, msg->body, msg->length);
+
+    int64_t start = monotonic_ns();
+    int ret = ctx->transport.ops->write_frame(&ctx->transport, message, msg->length + 1);
+    histogram_add(&metrics.write_time, monotonic_ns() - start);
+    note_bus_activity(1, monotonic_ns());
+
+    int result;
+    if (ret == 0) {
+        result = HDMI_RESULT_SUCCESS;
+    } else if (ret == -EBUSY) {
+        result = HDMI_RESULT_BUSY;
+    } else if (ret == -EIO) {
+        result = HDMI_RESULT_NACK;
+    } else {
+        result = HDMI_RESULT_FAIL;
+    }
+    errno = -ret;
+
+    trace_frame(CEC_TRACE_TX_ATTEMPT, result, 1, message, msg->length + 1);
+    return result;
+}
+
+static int transmit_message(hdmi_cec_context_t *ctx, const cec_message_t *msg) {
+    int result = topology_cached_poll(msg);
+    if (result >= 0) {
+        trace_message(CEC_TRACE_TX_DONE, result, 0, msg);
+        return result;
+    }
+
+    int busy_retries, nack_retries;
+    get_retry_limits(ctx, msg, &busy_retries, &nack_retries);
+
+    result = HDMI_RESULT_FAIL;
+    int attempts = 0;
+    int sft = __atomic_load_n(&last_bus_activity_tx, __ATOMIC_RELAXED) ?
+              CEC_SFT_NEXT_FRAME : CEC_SFT_NEW_INITIATOR;
+
+    for (int attempt = 0; ; attempt++) {
+        wait_signal_free_time(sft);
+
+        int64_t start = monotonic_ns();
+        result = transmit_attempt(ctx, msg);
+        int errno_value = errno;
+        attempts++;
+
+        ALOGV("hdmi-cec send attempt=%d initiator=%d destination=%d opcode=%02x result=%d took=%lldus",
+              attempt, msg->initiator, msg->destination, msg->length ? msg->body[0] : 0,
+              result, (long long) (monotonic_ns() - start) / 1000);
+
+        if (result == HDMI_RESULT_BUSY && busy_retries-- > 0) {
+            // lost arbitration, wait for the bus as a new initiator would
+            sft = CEC_SFT_NEW_INITIATOR;
+        } else if (result == HDMI_RESULT_NACK && nack_retries-- > 0) {
+            sft = CEC_SFT_RETRANSMIT;
+        } else {
+            errno = errno_value;
+            break;
+        }
+    }
+
+    trace_message(CEC_TRACE_TX_DONE, result, attempts, msg);
+    count_message(metrics.tx_opcodes, &metrics.tx_polls, msg->body, msg->length);
+    __atomic_fetch_add(&metrics.tx_results[result], 1, __ATOMIC_RELAXED);
+    topology_transmitted(msg, result);
+
+    if (result == HDMI_RESULT_SUCCESS) {
+        ALOGV("hdmi-cec sent initiator=%d destination=%d length=%zu msg=%02x %02x %02x",
+              msg->initiator, msg->destination, msg->length,
+              msg->body[0], msg->body[1], msg->body[2]);
+    } else {
+        ALOGW("hdmi-cec sent failed initiator=%d destination=%d length=%zu msg=%02x %02x %02x errno=%d",
+              msg->initiator, msg->destination, msg->length,
+              msg->body[0], msg->body[1], msg->body[2],
+              errno);
+    }
+    return result;
+}
+
+static int tx_priority(const cec_message_t *msg) {
+    if (msg->length == 0) {
+        return TX_PRIORITY_POLL;
+    } else if (msg->destination != CEC_ADDR_BROADCAST) {
+        return TX_PRIORITY_DIRECTED;
+    } else {
+        return TX_PRIORITY_BROADCAST;
+    }
+}
+
+static int queue_message(const cec_message_t *msg, tx_done_callback_t done, void *done_arg) {
+    int priority = tx_priority(msg);
+
+    pthread_mutex_lock(&tx_queue.lock);
+    if (!tx_queue.running || tx_queue.stopping) {
+        pthread_mutex_unlock(&tx_queue.lock);
+        return HDMI_RESULT_FAIL;
+    }
+    if (tx_queue.count[priority] >= TX_QUEUE_SIZE) {
+        pthread_mutex_unlock(&tx_queue.lock);
+        // callers get BUSY, dropped automatic replies are counted, a storm
+        // must not flood the log from process_thread
+        ALOGV("queue_message: queue full priority=%d", priority);
+        return HDMI_RESULT_BUSY;
+    }
+
+    int index = (tx_queue.head[priority] + tx_queue.count[priority]) % TX_QUEUE_SIZE;
+    tx_request_t *request = &tx_queue.requests[priority][index];
+    request->msg = *msg;
+    request->done = done;
+    request->done_arg = done_arg;
+    tx_queue.count[priority]++;
+
+    pthread_cond_signal(&tx_queue.cond);
+    pthread_mutex_unlock(&tx_queue.lock);
+    return HDMI_RESULT_SUCCESS;
+}
+
+static void tx_wait_done(const cec_message_t *msg, int result, void *arg) {
+    tx_wait_t *wait = arg;
+
+    pthread_mutex_lock(&tx_queue.lock);
+    wait->result = result;
+    wait->done = 1;
+    pthread_cond_broadcast(&tx_queue.done_cond);
+    pthread_mutex_unlock(&tx_queue.lock);
+}
+
+static void tx_log_done(const cec_message_t *msg, int result, void *arg) {
+    if (result != HDMI_RESULT_SUCCESS) {
+        ALOGW("hdmi-cec async send failed initiator=%d destination=%d opcode=%02x result=%d",
+              msg->initiator, msg->destination, msg->length ? msg->body[0] : 0, result);
+    }
+}
+
+static int pop_tx_request(tx_request_t *request) {
+    for (int priority = 0; priority < TX_PRIORITY_COUNT; priority++) {
+        if (tx_queue.count[priority] == 0) {
+            continue;
+        }
+        *request = tx_queue.requests[priority][tx_queue.head[priority]];
+        tx_queue.head[priority] = (tx_queue.head[priority] + 1) % TX_QUEUE_SIZE;
+        tx_queue.count[priority]--;
+        return 1;
+    }
+    return 0;
+}
+
+static void *tx_thread(void *arg) {
+    hdmi_cec_context_t *ctx = arg;
+    tx_request_t request;
+
+    pthread_mutex_lock(&tx_queue.lock);
+    for (;;) {
+        if (!pop_tx_request(&request)) {
+            if (tx_queue.stopping) {
+                break;
+            }
+            pthread_cond_wait(&tx_queue.cond, &tx_queue.lock);
+            continue;
+        }
+        int stopping = tx_queue.stopping;
+        pthread_mutex_unlock(&tx_queue.lock);
+
+        int result = stopping ? HDMI_RESULT_FAIL : transmit_message(ctx, &request.msg);
+        if (request.done) {
+            request.done(&request.msg, result, request.done_arg);
+        }
+
+        pthread_mutex_lock(&tx_queue.lock);
+    }
+    pthread_mutex_unlock(&tx_queue.lock);
+    return NULL;
+}
+
+static int start_tx_thread(hdmi_cec_context_t *ctx) {
+    memset(tx_queue.head, 0, sizeof(tx_queue.head));
+    memset(tx_queue.count, 0, sizeof(tx_queue.count));
+    tx_queue.stopping = 0;
+
+    int ret = pthread_create(&tx_queue.thread, NULL, tx_thread, ctx);
+    if (ret != 0) {
+        ALOGE("start_tx_thread: unable to start thread=%d", ret);
+        return -1;
+    }
+    tx_queue.running = 1;
+    return 0;
+}
+
+static void stop_tx_thread(void) {
+    if (!tx_queue.running) {
+        return;
+    }
+
+    // whatever is still queued is completed with HDMI_RESULT_FAIL
+    pthread_mutex_lock(&tx_queue.lock);
+    tx_queue.stopping = 1;
+    pthread_cond_signal(&tx_queue.cond);
+    pthread_mutex_unlock(&tx_queue.lock);
+
+    pthread_join(tx_queue.thread, NULL);
+    tx_queue.running = 0;
+}
+
+// Answers a framework query with the report the device sent within the
+// TTL. The reply is handed to process_thread, the only producer of rx_ring.
+// A device that changed its answer without sending a report, say a new OSD
+// name, is answered for with the old one for up to topology_ttl_ms after
+// that report. Nothing on the bus tells us, only a NACK drops the entry.
+static int topology_cached_query(hdmi_cec_context_t *ctx, const cec_message_t *msg) {
+    if (msg->length != 1 || msg->destination >= CEC_ADDR_BROADCAST) {
+        return 0;
+    }
+    int index = find_topology_report(msg->body[0], 1);
+    if (index < 0 || !topology_queries[index].cached) {
+        return 0;
+    }
+
+    int answered = 0;
+    pthread_mutex_lock(&topology_lock);
+    topology_report_t *report = &topology[msg->destination].reports[index];
+    if (topology_is_fresh(report->received_ns, monotonic_ns()) &&
+        topology_reply_count < TOPOLOGY_REPLY_QUEUE_SIZE) {
+        cec_message_t *reply = &topology_replies[topology_reply_count++];
+        reply->initiator = msg->destination;
+        reply->destination = report->destination == CEC_ADDR_BROADCAST ? CEC_ADDR_BROADCAST : msg->initiator;
+        reply->length = report->length;
+        memcpy(reply->body, report->body, report->length);
+        answered = 1;
+    }
+    pthread_mutex_unlock(&topology_lock);
+
+    if (answered) {
+        __atomic_fetch_add(&metrics.topology_query_hits, 1, __ATOMIC_RELAXED);
+        wake_process_thread(ctx, PROCESS_WAKE_TOPOLOGY);
+    }
+    return answered;
+}
+
+static void discovery_done(const cec_message_t *msg, int result, void *arg);
+
+// Polls the next address discovery has not got to. Returns 0 and ends the
+// discovery once every address was polled or the queue refused the poll.
+static int discovery_poll_next(hdmi_cec_context_t *ctx) {
+    int initiator = __atomic_load_n(&ctx->logical_address, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        pthread_mutex_lock(&topology_lock);
+        int addr = discovery_next_address;
+        if (addr < CEC_ADDR_BROADCAST) {
+            discovery_next_address++;
+        }
+        if (initiator == CEC_DEVICE_INACTIVE || addr >= CEC_ADDR_BROADCAST) {
+            discovery_running = 0;
+            pthread_mutex_unlock(&topology_lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&topology_lock);
+
+        if (is_logical_address(ctx, addr)) {
+            continue;
+        }
+
+        cec_message_t poll;
+        memset(&poll, 0, sizeof(poll));
+        poll.initiator = initiator;
+        poll.destination = addr;
+        if (queue_message(&poll, discovery_done, ctx) != HDMI_RESULT_SUCCESS) {
+            ALOGV("discovery_poll_next: stopped at address=%d", addr);
+            pthread_mutex_lock(&topology_lock);
+            discovery_running = 0;
+            pthread_mutex_unlock(&topology_lock);
+            return 0;
+        }
+        __atomic_fetch_add(&metrics.discovery_frames, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+}
+
+// Once a device acknowledged a frame, asks it for the next report it did
+// not send within the TTL, then polls the next address. Only one discovery
+// frame is queued at a time, so the framework frames always find room in
+// the queue and never wait behind a burst of our own.
+static void discovery_done(const cec_message_t *msg, int result, void *arg) {
+    hdmi_cec_context_t *ctx = arg;
+    if (result != HDMI_RESULT_SUCCESS || !is_logical_address(ctx, msg->initiator)) {
+        discovery_poll_next(ctx);
+        return;
+    }
+
+    int index = msg->length ? find_topology_report(msg->body[0], 1) + 1 : 0;
+    int64_t now = monotonic_ns();
+    pthread_mutex_lock(&topology_lock);
+    while (index < TOPOLOGY_REPORT_COUNT &&
+           topology_is_fresh(topology[msg->destination].reports[index].received_ns, now)) {
+        index++;
+    }
+    pthread_mutex_unlock(&topology_lock);
+    if (index >= TOPOLOGY_REPORT_COUNT) {
+        discovery_poll_next(ctx);
+        return;
+    }
+
+    cec_message_t query;
+    memset(&query, 0, sizeof(query));
+    query.initiator = msg->initiator;
+    query.destination = msg->destination;
+    query.length = 1;
+    query.body[0] = topology_queries[index].request;
+    if (queue_message(&query, discovery_done, ctx) == HDMI_RESULT_SUCCESS) {
+        __atomic_fetch_add(&metrics.discovery_frames, 1, __ATOMIC_RELAXED);
+    } else {
+        discovery_poll_next(ctx);
+    }
+}
+
+// Polls every other address through the TX queue, when we get a logical
+// address and on every connect, ahead of the framework doing the same
+// one address at a time. A discovery already running starts over from the
+// first address once its frame in flight is done.
+static void start_discovery(hdmi_cec_context_t *ctx) {
+    int initiator = __atomic_load_n(&ctx->logical_address, __ATOMIC_ACQUIRE);
+    if (!discovery_enabled || initiator == CEC_DEVICE_INACTIVE) {
+        return;
+    }
+
+    pthread_mutex_lock(&topology_lock);
+    int running = discovery_running;
+    discovery_running = 1;
+    discovery_next_address = 0;
+    pthread_mutex_unlock(&topology_lock);
+
+    ALOGV("start_discovery: initiator=%d running=%d", initiator, running);
+    if (!running) {
+        discovery_poll_next(ctx);
+    }
+}
+
+static int send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (ctx->transport.fd < 0) {
+        ALOGE("send_message: not ready");
+        return HDMI_RESULT_FAIL;
+    }
+
+    if (topology_cached_query(ctx, msg)) {
+        return HDMI_RESULT_SUCCESS;
+    }
+
+    // With async_tx a broadcast returns HDMI_RESULT_SUCCESS once it is
+    // queued, a failure after the retries is only logged. Nobody has to
+    // acknowledge a broadcast, so the framework learns nothing from the
+    // result. Directed frames and polls always wait: the framework takes
+    // a NACK as the device being gone and allocates addresses from polls.
+    if (tx_async && tx_priority(msg) == TX_PRIORITY_BROADCAST) {
+        return queue_message(msg, tx_log_done, NULL);
+    }
+
+    tx_wait_t wait = {0, HDMI_RESULT_FAIL};
+    int ret = queue_message(msg, tx_wait_done, &wait);
+    if (ret != HDMI_RESULT_SUCCESS) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&tx_queue.lock);
+    while (!wait.done) {
+        pthread_cond_wait(&tx_queue.done_cond, &tx_queue.lock);
+    }
+    pthread_mutex_unlock(&tx_queue.lock);
+    return wait.result;
+}
+
+static void signal_dispatcher(void) {
+    uint64_t value = 1;
+    if (write(rx_ring.event_fd, &value, sizeof(value)) < 0) {
+        ALOGW("signal_dispatcher: failed=%d", errno);
+    }
+}
+
+static void dispatch_event(const hdmi_event_t *event) {
+    unsigned int head = __atomic_load_n(&rx_ring.head, __ATOMIC_ACQUIRE);
+    unsigned int tail = rx_ring.tail;
+    unsigned int used = tail - head;
+
+    if (used >= RX_RING_SIZE) {
+        __atomic_fetch_add(&rx_ring.overflows, 1, __ATOMIC_RELAXED);
+        if (event->type == HDMI_EVENT_CEC_MESSAGE) {
+            trace_message(CEC_TRACE_RX_DROP, 0, 0, &event->cec);
+        } else {
+            trace_frame(CEC_TRACE_RX_DROP, 0, 0, NULL, 0);
+        }
+        ALOGW("dispatch_event: ring full, dropping type=%d", event->type);
+        return;
+    }
+
+    rx_ring.events[tail % RX_RING_SIZE] = *event;
+    __atomic_store_n(&rx_ring.tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (used + 1 > __atomic_load_n(&rx_ring.high_water, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rx_ring.high_water, used + 1, __ATOMIC_RELAXED);
+    }
+
+    // only pay for the syscall when the dispatcher is about to sleep
+    if (__atomic_exchange_n(&rx_ring.waiting, 0, __ATOMIC_SEQ_CST)) {
+        signal_dispatcher();
+    }
+}
+
+static void *dispatch_thread(void *arg) {
+    hdmi_cec_context_t *ctx = arg;
+
+    for (;;) {
+        unsigned int head = rx_ring.head;
+
+        if (head == __atomic_load_n(&rx_ring.tail, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&rx_ring.stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            __atomic_store_n(&rx_ring.waiting, 1, __ATOMIC_SEQ_CST);
+            if (head != __atomic_load_n(&rx_ring.tail, __ATOMIC_SEQ_CST)) {
+                __atomic_store_n(&rx_ring.waiting, 0, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            uint64_t value;
+            if (read(rx_ring.event_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+                ALOGE("dispatch_thread: read failed=%d", errno);
+                break;
+            }
+            continue;
+        }
+
+        hdmi_event_t event = rx_ring.events[head % RX_RING_SIZE];
+        __atomic_store_n(&rx_ring.head, head + 1, __ATOMIC_RELEASE);
+
+        void *callback_arg;
+        event_callback_t callback = get_callback(ctx, &callback_arg);
+        if (callback) {
+            int64_t start = monotonic_ns();
+            callback(&event, callback_arg);
+            histogram_add(&metrics.callback_time, monotonic_ns() - start);
+        }
+        __atomic_fetch_add(&rx_ring.dispatched, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int start_dispatch_thread(hdmi_cec_context_t *ctx) {
+    rx_ring.head = rx_ring.tail = 0;
+    rx_ring.waiting = 0;
+    rx_ring.stopping = 0;
+
+    rx_ring.event_fd = eventfd(0, EFD_CLOEXEC);
+    if (rx_ring.event_fd < 0) {
+        ALOGE("start_dispatch_thread: unable to create eventfd=%d", errno);
+        return -1;
+    }
+
+    int ret = pthread_create(&rx_ring.thread, NULL, dispatch_thread, ctx);
+    if (ret != 0) {
+        ALOGE("start_dispatch_thread: unable to start thread=%d", ret);
+        close(rx_ring.event_fd);
+        rx_ring.event_fd = -1;
+        return -1;
+    }
+    rx_ring.running = 1;
+    return 0;
+}
+
+static void stop_dispatch_thread(void) {
+    if (!rx_ring.running) {
+        return;
+    }
+
+    // events already queued are still delivered
+    __atomic_store_n(&rx_ring.stopping, 1, __ATOMIC_SEQ_CST);
+    signal_dispatcher();
+    pthread_join(rx_ring.thread, NULL);
+    rx_ring.running = 0;
+
+    close(rx_ring.event_fd);
+    rx_ring.event_fd = -1;
+
+    ALOGI("stop_dispatch_thread: dispatched=%u overflows=%u high_water=%u",
+          rx_ring.dispatched, rx_ring.overflows, rx_ring.high_water);
+}
+
+void sunxi_hdmi_cec_get_rx_stats(sunxi_hdmi_cec_rx_stats_t *stats) {
+    unsigned int head = __atomic_load_n(&rx_ring.head, __ATOMIC_ACQUIRE);
+    unsigned int tail = __atomic_load_n(&rx_ring.tail, __ATOMIC_ACQUIRE);
+
+    stats->size = RX_RING_SIZE;
+    stats->pending = tail - head;
+    stats->dispatched = __atomic_load_n(&rx_ring.dispatched, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&rx_ring.overflows, __ATOMIC_RELAXED);
+    stats->high_water = __atomic_load_n(&rx_ring.high_water, __ATOMIC_RELAXED);
+}
+
+// returns 1 if the event went to the framework
+static int hotplug_event(struct hdmi_cec_device *dev, int port_id, int connected) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (!__atomic_load_n(&ctx->system_control, __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+
+    hdmi_event_t event;
+    event.type = HDMI_EVENT_HOT_PLUG;
+    event.dev = dev;
+    event.hotplug.port_id = port_id;
+    event.hotplug.connected = connected;
+
+    ALOGI("hdmi-hotplug: port_id=%d connected=%d",
+          port_id, connected);
+
+    dispatch_event(&event);
+    return 1;
+}
+
+static void commit_hotplug(hdmi_cec_context_t *ctx) {
+    int connected = ctx->hotplug_input;
+
+    ctx->hotplug_pending = 0;
+    // without system control the framework is not told, the state is
+    // reported once it takes control back, see set_option
+    if (connected != ctx->hotplug_reported && hotplug_event(&ctx->device, 0, connected)) {
+        ctx->hotplug_reported = connected;
+    }
+    if (connected == ctx->hotplug_committed) {
+        return;
+    }
+    ctx->hotplug_committed = connected;
+    __atomic_store_n(&ctx->connected, connected, __ATOMIC_RELEASE);
+    __atomic_fetch_add(connected ? &metrics.hotplug_connects : &metrics.hotplug_disconnects,
+                       1, __ATOMIC_RELAXED);
+
+    if (connected) {
+        start_discovery(ctx);
+    } else {
+        topology_reset();
+    }
+}
+
+// Called from process_thread for every link change the device reports,
+// and when the TV talks to us. The framework only hears about a state
+// that held for the debounce time, a flap back to the committed state
+// within it is absorbed and counted.
+static void hotplug_changed(hdmi_cec_context_t *ctx, int connected) {
+    ctx->hotplug_input = connected;
+
+    if (connected == ctx->hotplug_committed) {
+        if (ctx->hotplug_pending) {
+            arm_timer(ctx->hotplug_timer_fd, 0);
+            ctx->hotplug_pending = 0;
+            __atomic_fetch_add(&metrics.hotplug_bounces, 1, __ATOMIC_RELAXED);
+            ALOGV("hotplug_changed: bounce absorbed connected=%d", connected);
+        }
+        if (connected != ctx->hotplug_reported) {
+            // the link held, only the framework missed it
+            commit_hotplug(ctx);
+        }
+        return;
+    }
+
+    if (ctx->hotplug_debounce_ms <= 0 || ctx->hotplug_timer_fd < 0) {
+        commit_hotplug(ctx);
+    } else if (!ctx->hotplug_pending) {
+        arm_timer(ctx->hotplug_timer_fd, ctx->hotplug_debounce_ms);
+        ctx->hotplug_pending = 1;
+    }
+}
+
+// Automatic replies go through the TX queue, so process_thread never
+// waits for the bus and a reply takes its turn behind the framework frames.
+// A handler whose reply was not queued leaves the request to the framework.
+static int send_cec_message(struct hdmi_cec_device *dev, int initiator, int destination, const unsigned char *data,
+                            size_t length) {
+    cec_message_t msg;
+    msg.initiator = initiator;
+    msg.destination = destination;
+    msg.length = length;
+    memcpy(msg.body, data, length);
+
+    int result = queue_message(&msg, tx_log_done, NULL);
+    if (result != HDMI_RESULT_SUCCESS) {
+        __atomic_fetch_add(&metrics.tx_dropped[data[0]], 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+static int get_device_type(int address) {
+    switch (address) {
+        case CEC_ADDR_TV:
+            return CEC_DEVICE_TV;
+        case CEC_ADDR_RECORDER_1:
+        case CEC_ADDR_RECORDER_2:
+        case CEC_ADDR_RECORDER_3:
+            return CEC_DEVICE_RECORDER;
+        case CEC_ADDR_TUNER_1:
+        case CEC_ADDR_TUNER_2:
+        case CEC_ADDR_TUNER_3:
+        case CEC_ADDR_TUNER_4:
+            return CEC_DEVICE_TUNER;
+        case CEC_ADDR_AUDIO_SYSTEM:
+            return CEC_DEVICE_AUDIO_SYSTEM;
+        default:
+            return CEC_DEVICE_PLAYBACK;
+    }
+}
+
+static int respond_deck_status(struct hdmi_cec_device *dev, int initiator, int destination,
+                               const unsigned char *data, size_t length) {
+    unsigned char reply[] = {CEC_MESSAGE_DECK_STATUS, 0x20};
+    return send_cec_message(dev, destination, initiator, reply, sizeof(reply)) == HDMI_RESULT_SUCCESS;
+}
+
+static int respond_osd_name(struct hdmi_cec_device *dev, int initiator, int destination,
+                            const unsigned char *data, size_t length) {
+    unsigned char reply[1 + CEC_OSD_NAME_MAX_LENGTH] = {CEC_MESSAGE_SET_OSD_NAME};
+    size_t name_length = strlen(osd_name);
+    memcpy(reply + 1, osd_name, name_length);
+    return send_cec_message(dev, destination, initiator, reply, 1 + name_length) == HDMI_RESULT_SUCCESS;
+}
+
+static int respond_cec_version(struct hdmi_cec_device *dev, int initiator, int destination,
+                               const unsigned char *data, size_t length) {
+    unsigned char reply[] = {CEC_MESSAGE_CEC_VERSION, CEC_VERSION_1_4};
+    return send_cec_message(dev, destination, initiator, reply, sizeof(reply)) == HDMI_RESULT_SUCCESS;
+}
+
+static int respond_physical_address(struct hdmi_cec_device *dev, int initiator, int destination,
+                                    const unsigned char *data, size_t length) {
+    uint16_t address = 0;
+    if (get_physical_address(dev, &address) < 0) {
+        // let the framework deal with it
+        return 0;
+    }
+
+    unsigned char reply[] = {
+            CEC_MESSAGE_REPORT_PHYSICAL_ADDRESS,
+            address >> 8,
+            address,
+            get_device_type(destination)
+    };
+    return send_cec_message(dev, destination, CEC_ADDR_BROADCAST, reply, sizeof(reply)) == HDMI_RESULT_SUCCESS;
+}
+
+static int respond_power_status(struct hdmi_cec_device *dev, int initiator, int destination,
+                                const unsigned char *data, size_t length) {
+    // the framework hands system control back when it goes to standby
+    int powered = __atomic_load_n(&context_of(dev)->system_control, __ATOMIC_ACQUIRE);
+    unsigned char reply[] = {CEC_MESSAGE_REPORT_POWER_STATUS, powered ? CEC_POWER_ON : CEC_POWER_STANDBY};
+    return send_cec_message(dev, destination, initiator, reply, sizeof(reply)) == HDMI_RESULT_SUCCESS;
+}
+
+static int respond_vendor_id(struct hdmi_cec_device *dev, int initiator, int destination,
+                             const unsigned char *data, size_t length) {
+    uint32_t vendor_id = 0;
+    get_vendor_id(dev, &vendor_id);
+
+    unsigned char reply[] = {
+            CEC_MESSAGE_DEVICE_VENDOR_ID,
+            vendor_id >> 16,
+            vendor_id >> 8,
+            vendor_id
+    };
+    return send_cec_message(dev, destination, CEC_ADDR_BROADCAST, reply, sizeof(reply)) == HDMI_RESULT_SUCCESS;
+}
+
+static int handle_tv_vendor_id(struct hdmi_cec_device *dev, int initiator, int destination,
+                               const unsigned char *data, size_t length) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (initiator != CEC_DEVICE_TV) {
+        return 0;
+    }
+    // the TV is obviously there, even if the driver missed the hotplug
+    hotplug_changed(ctx, 1);
+    int logical_address = __atomic_load_n(&ctx->logical_address, __ATOMIC_ACQUIRE);
+    if (logical_address == CEC_DEVICE_INACTIVE) {
+        return 0;
+    }
+
+    // We broadcast our vendor ID
+    uint32_t vendor_id = 0;
+    get_vendor_id(dev, &vendor_id);
+
+    unsigned char reply[] = {
+            CEC_MESSAGE_DEVICE_VENDOR_ID,
+            vendor_id >> 16,
+            vendor_id >> 8,
+            vendor_id
+    };
+    // the framework gets the TV vendor ID either way, a dropped reply is counted
+    send_cec_message(dev, logical_address, CEC_ADDR_BROADCAST, reply, sizeof(reply));
+    return 0;
+}
+
+// CEC UI command codes, see CEC 1.4 table 27, to Linux key codes
+static const unsigned short default_keymap[][2] = {
+    {0x00, KEY_SELECT},
+    {0x01, KEY_UP},
+    {0x02, KEY_DOWN},
+    {0x03, KEY_LEFT},
+    {0x04, KEY_RIGHT},
+    {0x09, KEY_HOMEPAGE},
+    {0x0a, KEY_SETUP},
+    {0x0b, KEY_MENU},
+    {0x0d, KEY_BACK},
+    {0x20, KEY_0},
+    {0x21, KEY_1},
+    {0x22, KEY_2},
+    {0x23, KEY_3},
+    {0x24, KEY_4},
+    {0x25, KEY_5},
+    {0x26, KEY_6},
+    {0x27, KEY_7},
+    {0x28, KEY_8},
+    {0x29, KEY_9},
+    {0x30, KEY_CHANNELUP},
+    {0x31, KEY_CHANNELDOWN},
+    {0x35, KEY_INFO},
+    {0x41, KEY_VOLUMEUP},
+    {0x42, KEY_VOLUMEDOWN},
+    {0x43, KEY_MUTE},
+    {0x44, KEY_PLAY},
+    {0x45, KEY_STOP},
+    {0x46, KEY_PAUSE},
+    {0x48, KEY_REWIND},
+    {0x49, KEY_FASTFORWARD},
+    {0x4b, KEY_NEXTSONG},
+    {0x4c, KEY_PREVIOUSSONG},
+    {0x53, KEY_EPG},
+    {0x61, KEY_PLAYPAUSE},
+    {0x71, KEY_BLUE},
+    {0x72, KEY_RED},
+    {0x73, KEY_GREEN},
+    {0x74, KEY_YELLOW},
+};
+
+// One "ui_command key_code" pair per line, ie. "0x0d 158", both numbers
+// in C notation. A key code of 0 leaves the command to the framework.
+static void load_keymap(void) {
+    char path[CONFIG_VALUE_MAX];
+
+    memset(keymap, 0, sizeof(keymap));
+    for (size_t i = 0; i < sizeof(default_keymap) / sizeof(default_keymap[0]); i++) {
+        keymap[default_keymap[i][0]] = default_keymap[i][1];
+    }
+
+    if (!get_config_string("keymap_file", path, NULL) || !path[0]) {
+        return;
+    }
+
+    FILE *file = fopen(path, "re");
+    if (!file) {
+        ALOGW("load_keymap: unable to open %s: %d", path, errno);
+        return;
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        char *end;
+        long command = strtol(line, &end, 0);
+        if (end == line || line[0] == '#') {
+            continue;
+        }
+        char *key_end;
+        long key = strtol(end, &key_end, 0);
+        if (key_end == end || command < 0 || command > 0xff || key < 0 || key > KEY_MAX) {
+            ALOGW("load_keymap: ignoring %s", line);
+            continue;
+        }
+        keymap[command] = key;
+    }
+    fclose(file);
+}
+
+static void emit_key(hdmi_cec_context_t *ctx, int key, int value) {
+    struct input_event events[2];
+    memset(events, 0, sizeof(events));
+    events[0].type = EV_KEY;
+    events[0].code = key;
+    events[0].value = value;
+    events[1].type = EV_SYN;
+    events[1].code = SYN_REPORT;
+
+    if (write(ctx->uinput_fd, events, sizeof(events)) < 0) {
+        ALOGW("emit_key: key=%d value=%d failed=%d", key, value, errno);
+    }
+}
+
+static void release_key(hdmi_cec_context_t *ctx) {
+    if (ctx->pressed_key) {
+        emit_key(ctx, ctx->pressed_key, 0);
+        ctx->pressed_key = 0;
+    }
+    arm_timer(ctx->key_timer_fd, 0);
+}
+
+// The key stays down while the TV repeats User Control Pressed, the input
+// stack generates the repeats at its own steady rate. A lost release is
+// covered by the user control timeout.
+static int handle_key_pressed(struct hdmi_cec_device *dev, int initiator, int destination,
+                              const unsigned char *data, size_t length) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (ctx->uinput_fd < 0 || length < 1 || !keymap[data[0]]) {
+        return 0;
+    }
+    // injecting keys is automatic behaviour, gated on system control like
+    // the rest in cec_event; a key already down is still released
+    if (!__atomic_load_n(&ctx->system_control, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    int key = keymap[data[0]];
+    if (ctx->pressed_key != key) {
+        release_key(ctx);
+        emit_key(ctx, key, 1);
+        ctx->pressed_key = key;
+        histogram_add(&metrics.key_latency, monotonic_ns() - ctx->rx_timestamp_ns);
+    }
+    arm_timer(ctx->key_timer_fd, CEC_USER_CONTROL_TIMEOUT_MS);
+    return 1;
+}
+
+static int handle_key_released(struct hdmi_cec_device *dev, int initiator, int destination,
+                               const unsigned char *data, size_t length) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (ctx->uinput_fd < 0 || !ctx->pressed_key) {
+        // the press went to the framework, so does the release
+        return 0;
+    }
+
+    release_key(ctx);
+    return 1;
+}
+
+static int open_uinput(hdmi_cec_context_t *ctx) {
+    ctx->uinput_fd = open(CEC_UINPUT_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (ctx->uinput_fd < 0) {
+        return -errno;
+    }
+
+    struct uinput_user_dev setup;
+    memset(&setup, 0, sizeof(setup));
+    snprintf(setup.name, sizeof(setup.name), CEC_UINPUT_NAME);
+    setup.id.bustype = BUS_VIRTUAL;
+
+    int ret = 0;
+    if (ioctl(ctx->uinput_fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+        ioctl(ctx->uinput_fd, UI_SET_EVBIT, EV_REP) < 0) {
+        ret = -errno;
+    }
+    for (int command = 0; command < 256 && !ret; command++) {
+        if (keymap[command] && ioctl(ctx->uinput_fd, UI_SET_KEYBIT, keymap[command]) < 0) {
+            ret = -errno;
+        }
+    }
+    if (!ret && (write(ctx->uinput_fd, &setup, sizeof(setup)) != sizeof(setup) ||
+                 ioctl(ctx->uinput_fd, UI_DEV_CREATE) < 0)) {
+        ret = -errno;
+    }
+
+    ctx->key_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!ret && ctx->key_timer_fd < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        close(ctx->uinput_fd);
+        ctx->uinput_fd = -1;
+        if (ctx->key_timer_fd >= 0) {
+            close(ctx->key_timer_fd);
+            ctx->key_timer_fd = -1;
+        }
+    }
+    return ret;
+}
+
+static void close_uinput(hdmi_cec_context_t *ctx) {
+    if (ctx->uinput_fd < 0) {
+        return;
+    }
+
+    release_key(ctx);
+    ioctl(ctx->uinput_fd, UI_DEV_DESTROY);
+    close(ctx->uinput_fd);
+    ctx->uinput_fd = -1;
+    close(ctx->key_timer_fd);
+    ctx->key_timer_fd = -1;
+}
+
+// Answered in the HAL, because a lot of TVs time out waiting for the
+// framework round-trip. A handler returns 1 when the message is consumed.
+static const opcode_handler_t opcode_handlers[256] = {
+    [CEC_MESSAGE_GIVE_DECK_STATUS] = {respond_deck_status, OPCODE_DIRECTED},
+    [CEC_MESSAGE_GIVE_OSD_NAME] = {respond_osd_name, OPCODE_DIRECTED},
+    [CEC_MESSAGE_GET_CEC_VERSION] = {respond_cec_version, OPCODE_DIRECTED},
+    [CEC_MESSAGE_GIVE_PHYSICAL_ADDRESS] = {respond_physical_address, OPCODE_DIRECTED},
+    [CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS] = {respond_power_status, OPCODE_DIRECTED},
+    [CEC_MESSAGE_GIVE_DEVICE_VENDOR_ID] = {respond_vendor_id, OPCODE_DIRECTED},
+    [CEC_MESSAGE_DEVICE_VENDOR_ID] = {handle_tv_vendor_id, OPCODE_BROADCAST},
+    [CEC_MESSAGE_USER_CONTROL_PRESSED] = {handle_key_pressed, OPCODE_DIRECTED},
+    [CEC_MESSAGE_USER_CONTROL_RELEASED] = {handle_key_released, OPCODE_DIRECTED},
+};
+
+// Parses the next item of a comma separated "opcode[:value]" list,
+// ie. 0x8f:1000,0x85. Returns NULL at the end of the list.
+static const char *next_opcode_item(const char *p, int *opcode, long *value) {
+    for (;;) {
+        char *end;
+        long item = strtol(p, &end, 0);
+        if (end == p) {
+            return NULL;
+        }
+        if (*end == ':') {
+            p = end + 1;
+            *value = strtol(p, &end, 0);
+        }
+        p = *end == ',' ? end + 1 : end;
+        if (item >= 0 && item < 256) {
+            *opcode = item;
+            return p;
+        }
+    }
+}
+
+static void load_opcode_handlers(void) {
+    char value[CONFIG_VALUE_MAX];
+    int opcode;
+    long unused;
+
+    for (opcode = 0; opcode < 256; opcode++) {
+        opcode_enabled[opcode] = opcode_handlers[opcode].handler != NULL;
+    }
+
+    // comma separated list of opcodes left to the framework, ie. 0x46,0x9f
+    if (get_config_string("respond_off", value, NULL)) {
+        for (const char *p = value; (p = next_opcode_item(p, &opcode, &unused)); ) {
+            opcode_enabled[opcode] = 0;
+        }
+    }
+
+    if (!get_config_string("osd_name", osd_name, NULL) || !osd_name[0]) {
+        strcpy(osd_name, CEC_DEFAULT_OSD_NAME);
+    }
+    osd_name[CEC_OSD_NAME_MAX_LENGTH] = 0;
+}
+
+static int
+handle_cec_opcode(struct hdmi_cec_device *dev, int initiator, int destination,
+                  int opcode, const unsigned char *data, size_t length) {
+    const opcode_handler_t *entry = &opcode_handlers[opcode & 0xff];
+    if (!entry->handler || !opcode_enabled[opcode & 0xff]) {
+        return 0;
+    }
+
+    if ((entry->flags & OPCODE_DIRECTED) &&
+        !is_logical_address(context_of(dev), destination)) {
+        return 0;
+    }
+    if ((entry->flags & OPCODE_BROADCAST) && destination != CEC_ADDR_BROADCAST) {
+        return 0;
+    }
 
-#define MESSAGE_TYPE_RECEIVE_SUCCESS            1
-#define MESSAGE_TYPE_NOACK              2
-#define MESSAGE_TYPE_DISCONNECTED               3
-#define MESSAGE_TYPE_CONNECTED          4
-#define MESSAGE_TYPE_SEND_SUCCESS               5
-
-typedef struct hdmi_cec_event {
-    int event_type;
-    int msg_len;
-    unsigned char msg[17];
-} hdmi_cec_event_t;
-
-static int sunxi_hdmi_cec = -1;
-static int enabled = 0;
-static int powered = 0;
-static int system_control = 0;
-static pthread_t process_thread_handle = -1;
-static event_callback_t callback_func;
-static void *callback_arg;
-static cec_logical_address_t logical_address = CEC_DEVICE_INACTIVE;
+    int handled = entry->handler(dev, initiator, destination, data, length);
+    if (handled) {
+        unsigned char frame[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
+        frame[0] = (initiator << 4) | (destination & 0x0f);
+        frame[1] = opcode;
+        memcpy(frame + 2, data, length);
+        trace_frame(CEC_TRACE_RESPONSE, 0, 0, frame, length + 2);
+        __atomic_fetch_add(&opcode_responses[opcode & 0xff], 1, __ATOMIC_RELAXED);
+    }
+    return handled;
+}
 
-static void get_vendor_id(const struct hdmi_cec_device *dev, uint32_t *vendor_id) {
-    *vendor_id = CEC_VENDOR_PULSE_EIGHT;
+unsigned int sunxi_hdmi_cec_get_event_count(void) {
+    return __atomic_load_n(&metrics.rx_events, __ATOMIC_ACQUIRE);
 }
 
-static int add_logical_address(const struct hdmi_cec_device *dev, cec_logical_address_t addr) {
-    if (logical_address == addr) {
-        return 0;
+unsigned int sunxi_hdmi_cec_get_response_count(int opcode) {
+    return __atomic_load_n(&opcode_responses[opcode & 0xff], __ATOMIC_RELAXED);
+}
+
+// Requests some TVs repeat several times a second, answering one of
+// them is enough. Everything else reaches the framework unchanged.
+// A TV also repeats a query whose answer it did not get, that repeat is
+// dropped too when it comes within the window.
+static const int dedup_default_opcodes[] = {
+    CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS,
+    CEC_MESSAGE_REQUEST_ACTIVE_SOURCE,
+    CEC_MESSAGE_GIVE_PHYSICAL_ADDRESS,
+    CEC_MESSAGE_GIVE_OSD_NAME,
+    CEC_MESSAGE_GIVE_DEVICE_VENDOR_ID,
+    CEC_MESSAGE_GET_CEC_VERSION,
+    CEC_MESSAGE_GET_MENU_LANGUAGE,
+    CEC_MESSAGE_GIVE_DECK_STATUS,
+};
+
+static void load_dedup_policy(void) {
+    char value[CONFIG_VALUE_MAX];
+    int opcode;
+    long default_window, window;
+
+    memset(dedup_window_ms, 0, sizeof(dedup_window_ms));
+    memset(dedup_table, 0, sizeof(dedup_table));
+    if (!get_config_int("dedup", 1)) {
+        return;
     }
-    int ret = ioctl(sunxi_hdmi_cec, HDMICEC_IOC_SETLOGICALADDRESS, addr);
-    if (ret == 0) {
-        logical_address = addr;
-        ALOGV("add_logical_address: %d", addr);
+
+    default_window = get_config_int("dedup_window_ms", DEDUP_DEFAULT_WINDOW_MS);
+    for (size_t i = 0; i < sizeof(dedup_default_opcodes) / sizeof(dedup_default_opcodes[0]); i++) {
+        dedup_window_ms[dedup_default_opcodes[i]] = default_window;
+    }
+
+    // opcode[:window_ms] items added to or overriding the defaults, ie. 0x8f:1000,0x71
+    if (get_config_string("dedup_windows", value, NULL)) {
+        window = default_window;
+        for (const char *p = value; (p = next_opcode_item(p, &opcode, &window)); window = default_window) {
+            dedup_window_ms[opcode] = window > 0 ? (window < 65535 ? window : 65535) : 0;
+        }
+    }
+
+    // opcodes always delivered, ie. 0x85
+    if (get_config_string("dedup_passthrough", value, NULL)) {
+        for (const char *p = value; (p = next_opcode_item(p, &opcode, &window)); ) {
+            dedup_window_ms[opcode] = 0;
+        }
+    }
+}
+
+// Called from process_thread only. A frame is delivered at most once per
+// window, repeats are counted, not delivered. Colliding frames evict each
+// other, so a collision can only let a repeat through.
+static int is_duplicate_frame(int initiator, int destination, const unsigned char *data, size_t length) {
+    int window_ms = dedup_window_ms[data[0]];
+    if (!window_ms) {
         return 0;
-    } else {
-        ALOGE("add_logical_address: %d failed: %d", addr, errno);
-        return -errno;
     }
+
+    unsigned char frame[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
+    frame[0] = (initiator << 4) | (destination & 0x0f);
+    memcpy(frame + 1, data, length);
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length + 1; i++) {
+        hash = (hash ^ frame[i]) * 16777619u;
+    }
+
+    dedup_entry_t *entry = &dedup_table[hash & (DEDUP_TABLE_SIZE - 1)];
+    int64_t now = monotonic_ns();
+    if (entry->length == length + 1 && !memcmp(entry->frame, frame, length + 1) &&
+        now - entry->delivered_ns < window_ms * 1000000LL) {
+        __atomic_fetch_add(&metrics.rx_suppressed[data[0]], 1, __ATOMIC_RELAXED);
+        trace_frame(CEC_TRACE_RX_SUPPRESSED, 0, 0, frame, length + 1);
+        return 1;
+    }
+
+    entry->delivered_ns = now;
+    entry->length = length + 1;
+    memcpy(entry->frame, frame, length + 1);
+    return 0;
 }
 
-static void clear_logical_address(const struct hdmi_cec_device *dev) {
-    add_logical_address(dev, 15);
+unsigned int sunxi_hdmi_cec_get_suppressed_count(int opcode) {
+    return __atomic_load_n(&metrics.rx_suppressed[opcode & 0xff], __ATOMIC_RELAXED);
 }
 
-static int get_physical_address(const struct hdmi_cec_device *dev, uint16_t *addr) {
-    uint32_t addr32 = 0;
-    int ret = ioctl(sunxi_hdmi_cec, HDMICEC_IOC_GETPHYADDRESS, &addr32);
-    if (ret == 0) {
-        *addr = addr32;
-        ALOGV("get_physical_address: %d", *addr);
-        return 0;
-    } else {
-        ALOGE("get_physical_address: failed: %d", ret);
-        return -errno;
+unsigned int sunxi_hdmi_cec_get_dropped_count(int opcode) {
+    return __atomic_load_n(&metrics.tx_dropped[opcode & 0xff], __ATOMIC_RELAXED);
+}
+
+static void dump_histogram(int fd, const char *name, histogram_t *histogram) {
+    unsigned int count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t total_us = __atomic_load_n(&histogram->total_us, __ATOMIC_RELAXED);
+
+    dprintf(fd, "%s count=%u avg_us=%llu max_us=%u\n", name, count,
+            (unsigned long long) (count ? total_us / count : 0),
+            __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED));
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        unsigned int value = __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+        if (value) {
+            dprintf(fd, "%s le_us=%u count=%u\n", name, bucket ? (1u << bucket) - 1 : 0, value);
+        }
     }
 }
 
-static int send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg) {
-    if (sunxi_hdmi_cec < 0) {
-        ALOGE("send_message: not ready");
-        return HDMI_RESULT_FAIL;
+void sunxi_hdmi_cec_dump_metrics(int fd) {
+    sunxi_hdmi_cec_rx_stats_t rx_stats;
+    sunxi_hdmi_cec_get_rx_stats(&rx_stats);
+
+    dprintf(fd, "rx events=%u polls=%u read_errors=%u\n",
+            __atomic_load_n(&metrics.rx_events, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.rx_polls, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.read_errors, __ATOMIC_RELAXED));
+    dprintf(fd, "hotplug connects=%u disconnects=%u bounces=%u\n",
+            __atomic_load_n(&metrics.hotplug_connects, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.hotplug_disconnects, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.hotplug_bounces, __ATOMIC_RELAXED));
+    dprintf(fd, "topology poll_hits=%u query_hits=%u discovery_frames=%u\n",
+            __atomic_load_n(&metrics.topology_poll_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.topology_query_hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.discovery_frames, __ATOMIC_RELAXED));
+    dprintf(fd, "rx_ring size=%u pending=%u dispatched=%u overflows=%u high_water=%u\n",
+            rx_stats.size, rx_stats.pending, rx_stats.dispatched, rx_stats.overflows, rx_stats.high_water);
+    dprintf(fd, "tx polls=%u success=%u nack=%u busy=%u fail=%u\n",
+            __atomic_load_n(&metrics.tx_polls, __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.tx_results[HDMI_RESULT_SUCCESS], __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.tx_results[HDMI_RESULT_NACK], __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.tx_results[HDMI_RESULT_BUSY], __ATOMIC_RELAXED),
+            __atomic_load_n(&metrics.tx_results[HDMI_RESULT_FAIL], __ATOMIC_RELAXED));
+
+    for (int opcode = 0; opcode < 256; opcode++) {
+        unsigned int rx = __atomic_load_n(&metrics.rx_opcodes[opcode], __ATOMIC_RELAXED);
+        unsigned int tx = __atomic_load_n(&metrics.tx_opcodes[opcode], __ATOMIC_RELAXED);
+        unsigned int responses = sunxi_hdmi_cec_get_response_count(opcode);
+        unsigned int suppressed = sunxi_hdmi_cec_get_suppressed_count(opcode);
+        unsigned int dropped = sunxi_hdmi_cec_get_dropped_count(opcode);
+        if (rx || tx || responses || suppressed || dropped) {
+            dprintf(fd, "opcode=0x%02x rx=%u tx=%u responses=%u suppressed=%u dropped=%u\n",
+                    opcode, rx, tx, responses, suppressed, dropped);
+        }
     }
 
-    unsigned char message[CEC_MESSAGE_BODY_MAX_LENGTH + 1];
-    message[0] = (msg->initiator << 4) | (msg->destination & 0x0f);
-    memcpy(message + 1, msg->body, msg->length);
+    dump_histogram(fd, "callback_time", &metrics.callback_time);
+    dump_histogram(fd, "write_time", &metrics.write_time);
+    dump_histogram(fd, "read_latency", &metrics.read_latency);
+    dump_histogram(fd, "key_latency", &metrics.key_latency);
+}
 
-    int ret = write(sunxi_hdmi_cec, message, msg->length + 1);
-    if (ret >= 0) {
-        ALOGV("hdmi-cec sent initiator=%d destination=%d length=%zu msg=%02x %02x %02x",
-              msg->initiator, msg->destination, msg->length,
-              msg->body[0], msg->body[1], msg->body[2]);
-        return HDMI_RESULT_SUCCESS;
-    }
+void sunxi_hdmi_cec_dump_topology(int fd) {
+    topology_entry_t entries[CEC_ADDR_BROADCAST];
 
-    ALOGW("hdmi-cec sent failed initiator=%d destination=%d length=%zu msg=%02x %02x %02x errno=%d",
-          msg->initiator, msg->destination, msg->length,
-          msg->body[0], msg->body[1], msg->body[2],
-          errno);
+    pthread_mutex_lock(&topology_lock);
+    memcpy(entries, topology, sizeof(entries));
+    pthread_mutex_unlock(&topology_lock);
 
-    if (errno == EBUSY) {
-        return HDMI_RESULT_BUSY;
-    } else if (errno == EIO) {
-        return HDMI_RESULT_NACK;
-    } else {
-        return HDMI_RESULT_FAIL;
+    int64_t now = monotonic_ns();
+    for (int addr = 0; addr < CEC_ADDR_BROADCAST; addr++) {
+        topology_entry_t *entry = &entries[addr];
+        if (entry->present < 0) {
+            continue;
+        }
+
+        dprintf(fd, "address=%d present=%d age_ms=%lld", addr, entry->present,
+                (long long) (now - entry->present_ns) / 1000000);
+        for (int index = 0; index < TOPOLOGY_REPORT_COUNT; index++) {
+            const unsigned char *body = entry->reports[index].body;
+            if (!entry->reports[index].received_ns) {
+                continue;
+            }
+            switch (index) {
+                case TOPOLOGY_PHYSICAL_ADDRESS:
+                    dprintf(fd, " physical_address=%x.%x.%x.%x device_type=%d",
+                            body[1] >> 4, body[1] & 0x0f, body[2] >> 4, body[2] & 0x0f, body[3]);
+                    break;
+                case TOPOLOGY_VENDOR_ID:
+                    dprintf(fd, " vendor_id=%02x%02x%02x", body[1], body[2], body[3]);
+                    break;
+                case TOPOLOGY_OSD_NAME:
+                    dprintf(fd, " osd_name=\"%.*s\"", (int) entry->reports[index].length - 1, body + 1);
+                    break;
+                case TOPOLOGY_CEC_VERSION:
+                    dprintf(fd, " cec_version=%d", body[1]);
+                    break;
+                case TOPOLOGY_POWER_STATUS:
+                    dprintf(fd, " power_status=%d", body[1]);
+                    break;
+            }
+        }
+        dprintf(fd, "\n");
     }
 }
 
-static void hotplug_event(struct hdmi_cec_device *dev, int port_id, int connected) {
-    if (!system_control) {
-      return;
+int sunxi_hdmi_cec_dump_trace(int fd) {
+    uint32_t last = __atomic_load_n(&trace_sequence, __ATOMIC_ACQUIRE);
+    uint32_t first = last > TRACE_RING_SIZE ? last - TRACE_RING_SIZE + 1 : 1;
+
+    cec_trace_record_t *records = malloc(TRACE_RING_SIZE * sizeof(*records));
+    if (!records) {
+        return -ENOMEM;
     }
 
-    hdmi_event_t event;
-    event.type = HDMI_EVENT_HOT_PLUG;
-    event.dev = dev;
-    event.hotplug.port_id = port_id;
-    event.hotplug.connected = connected;
-    powered = connected;
+    cec_trace_header_t header = {
+        .magic = CEC_TRACE_MAGIC,
+        .version = CEC_TRACE_VERSION,
+        .record_size = sizeof(cec_trace_record_t),
+        .count = 0,
+        .dropped = first - 1,
+    };
 
-    ALOGI("hdmi-hotplug: port_id=%d connected=%d",
-          port_id, connected);
+    for (uint32_t sequence = first; sequence != last + 1; sequence++) {
+        cec_trace_record_t *record = &trace_ring[sequence % TRACE_RING_SIZE];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != sequence) {
+            continue;
+        }
+
+        records[header.count] = *record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != sequence) {
+            // overwritten while we were copying it
+            continue;
+        }
+        header.count++;
+    }
 
-    if (callback_func) {
-        callback_func(&event, callback_arg);
+    int ret = 0;
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, records, header.count * sizeof(*records)) != (ssize_t) (header.count * sizeof(*records))) {
+        ret = -errno;
     }
+    free(records);
+    return ret;
 }
 
-static int send_cec_message(struct hdmi_cec_device *dev, int initiator, int destination, const unsigned char *data,
-                            size_t length) {
-    cec_message_t msg;
-    msg.initiator = initiator;
-    msg.destination = destination;
-    msg.length = length;
-    memcpy(msg.body, data, length);
-    return send_message(dev, &msg);
+static void write_dump_file(const char *name, void (*dump)(int fd)) {
+    char path[CONFIG_VALUE_MAX];
+    if (!get_config_string(name, path, NULL) || !path[0]) {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ALOGW("write_dump_file: unable to open %s: %d", path, errno);
+        return;
+    }
+    dump(fd);
+    close(fd);
 }
 
-static int
-handle_cec_opcode(struct hdmi_cec_device *dev, int initiator, int destination,
-                  int opcode, const unsigned char *data, size_t length) {
-    switch (opcode) {
-        case CEC_MESSAGE_GIVE_DECK_STATUS: {
-            unsigned char data[] = {CEC_MESSAGE_DECK_STATUS, 0x20};
-            send_cec_message(dev, destination, initiator, data, 2);
-            return 1;
+static void dump_trace(int fd) {
+    sunxi_hdmi_cec_dump_trace(fd);
+}
+
+static void write_dump_files(void) {
+    write_dump_file("metrics_file", sunxi_hdmi_cec_dump_metrics);
+    write_dump_file("trace_file", dump_trace);
+    write_dump_file("topology_file", sunxi_hdmi_cec_dump_topology);
+}
+
+// The dump files are also written while the HAL runs, whenever the file
+// named by the trace_trigger tunable is written or touched. Its directory
+// is watched, so the file does not have to exist beforehand.
+static int open_trace_trigger(hdmi_cec_context_t *ctx) {
+    char path[CONFIG_VALUE_MAX];
+    if (!get_config_string("trace_trigger", path, NULL) || !path[0]) {
+        return -1;
+    }
+
+    char *slash = strrchr(path, '/');
+    if (path[0] != '/' || !slash[1]) {
+        ALOGW("open_trace_trigger: %s is not an absolute file path", path);
+        return -1;
+    }
+    snprintf(ctx->trace_trigger_name, sizeof(ctx->trace_trigger_name), "%s", slash + 1);
+    *slash = 0;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, path[0] ? path : "/", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ALOGW("open_trace_trigger: unable to watch %s: %d", path, errno);
+        if (fd >= 0) {
+            close(fd);
         }
+        return -1;
+    }
+    ALOGI("open_trace_trigger: watching %s/%s", path, ctx->trace_trigger_name);
+    return fd;
+}
 
-        case CEC_MESSAGE_DEVICE_VENDOR_ID: {
-            if (initiator != CEC_DEVICE_TV) {
-                break;
+// touch and echo close the file after writing it, mv moves it in place.
+// Events that queued up while the last dump was written take one more dump.
+static void handle_trace_trigger(hdmi_cec_context_t *ctx) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int triggered = 0;
+    ssize_t length;
+
+    while ((length = read(ctx->trace_trigger_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if (event->len && !strcmp(event->name, ctx->trace_trigger_name)) {
+                triggered = 1;
             }
-            if (!powered) {
-                hotplug_event(dev, 0, 1);
-            }
-
-            // We broadcast our vendor ID
-            uint32_t vendor_id = 0;
-            get_vendor_id(dev, &vendor_id);
-
-            unsigned char data[] = {
-                    CEC_MESSAGE_DEVICE_VENDOR_ID,
-                    vendor_id >> 16,
-                    vendor_id >> 8,
-                    vendor_id
-            };
-            send_cec_message(dev, logical_address, 15, data, 4);
-            return 0;
+            p += sizeof(*event) + event->len;
         }
     }
-    return 0;
+
+    if (triggered) {
+        ALOGI("handle_trace_trigger: writing the dump files");
+        write_dump_files();
+    }
 }
 
 static void
@@ -211,9 +2594,7 @@ cec_event(struct hdmi_cec_device *dev, int initiator, int destination, const uns
         return;
     }
 
-    if (!system_control) {
-      return;
-    }
+    hdmi_cec_context_t *ctx = context_of(dev);
 
     hdmi_event_t event;
     event.type = HDMI_EVENT_CEC_MESSAGE;
@@ -227,19 +2608,57 @@ cec_event(struct hdmi_cec_device *dev, int initiator, int destination, const uns
           event.cec.initiator, event.cec.destination, event.cec.length,
           event.cec.body[0], event.cec.body[1], event.cec.body[2]);
 
+    // accept filter: directed frames for addresses we do not own are dropped
+    if (destination != CEC_ADDR_BROADCAST &&
+        __atomic_load_n(&ctx->logical_address_mask, __ATOMIC_ACQUIRE) &&
+        !is_logical_address(ctx, destination)) {
+        return;
+    }
+
+    // while the framework is in standby the automatic replies still go out
     if (length >= 1 && handle_cec_opcode(dev, initiator, destination, data[0], data + 1, length - 1)) {
         return;
     }
 
-    if (callback_func) {
-        callback_func(&event, callback_arg);
+    if (!__atomic_load_n(&ctx->system_control, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+
+    if (is_duplicate_frame(initiator, destination, data, length)) {
+        return;
+    }
+
+    dispatch_event(&event);
+}
+
+// Replies answered from the topology cache reach the framework as if the
+// device had sent them
+static void deliver_topology_replies(hdmi_cec_context_t *ctx) {
+    cec_message_t replies[TOPOLOGY_REPLY_QUEUE_SIZE];
+
+    pthread_mutex_lock(&topology_lock);
+    int count = topology_reply_count;
+    memcpy(replies, topology_replies, count * sizeof(replies[0]));
+    topology_reply_count = 0;
+    pthread_mutex_unlock(&topology_lock);
+
+    if (!__atomic_load_n(&ctx->system_control, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        hdmi_event_t event;
+        event.type = HDMI_EVENT_CEC_MESSAGE;
+        event.dev = &ctx->device;
+        event.cec = replies[i];
+        trace_message(CEC_TRACE_RESPONSE, 0, 0, &replies[i]);
+        dispatch_event(&event);
     }
 }
 
 static void register_event_callback(const struct hdmi_cec_device *dev,
                                     event_callback_t callback, void *arg) {
-    callback_func = callback;
-    callback_arg = arg;
+    set_callback(context_of(dev), callback, arg);
     ALOGV("register_event_callback: %p", callback);
 }
 
@@ -249,16 +2668,13 @@ static void get_version(const struct hdmi_cec_device *dev, int *version) {
 
 static void get_port_info(const struct hdmi_cec_device *dev,
                           struct hdmi_port_info *list[], int *total) {
-    static hdmi_port_info_t info = {
-            .type = HDMI_OUTPUT,
-            .port_id = 0,
-            .cec_supported = 1,
-            .arc_supported = 0,
-            .physical_address = 0,
-    };
+    hdmi_cec_context_t *ctx = context_of(dev);
+    // only refreshes the cache when it is invalid, the port info follows it
+    uint16_t address = 0;
+    get_physical_address(dev, &address);
 
     *total = 1;
-    list[0] = &info;
+    list[0] = &ctx->port_info;
 }
 
 static void set_audio_return_channel(const struct hdmi_cec_device *dev, int port_id, int flag) {
@@ -266,23 +2682,18 @@ static void set_audio_return_channel(const struct hdmi_cec_device *dev, int port
 }
 
 static int is_connected(const struct hdmi_cec_device *dev, int port_id) {
-    return HDMI_CONNECTED; // or HDMI_NOT_CONNECTED
-}
-
-static int poll_data(int fd, int timeout_usec) {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
-
-    struct timeval timeout = {0, timeout_usec};
-
-    return select(fd + 1, &set, NULL, NULL, &timeout);
+    return __atomic_load_n(&context_of(dev)->connected, __ATOMIC_ACQUIRE) ?
+           HDMI_CONNECTED : HDMI_NOT_CONNECTED;
 }
 
 static void handle_cec_event(struct hdmi_cec_device *dev, const hdmi_cec_event_t *event) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+
     switch (event->event_type) {
         case MESSAGE_TYPE_RECEIVE_SUCCESS:
             if (event->msg_len >= 1) {
+                topology_observe(event->msg[0] >> 4, event->msg[0] & 0x0f,
+                                 event->msg + 1, event->msg_len - 1, ctx->rx_timestamp_ns);
                 cec_event(dev, event->msg[0] >> 4,
                           event->msg[0] & 0x0f,
                           event->msg + 1,
@@ -291,11 +2702,13 @@ static void handle_cec_event(struct hdmi_cec_device *dev, const hdmi_cec_event_t
             break;
 
         case MESSAGE_TYPE_CONNECTED:
-            hotplug_event(dev, 0, 1);
+            refresh_physical_address(ctx);
+            hotplug_changed(ctx, 1);
             break;
 
         case MESSAGE_TYPE_DISCONNECTED:
-            hotplug_event(dev, 0, 0);
+            refresh_physical_address(ctx);
+            hotplug_changed(ctx, 0);
             break;
 
         default:
@@ -304,102 +2717,438 @@ static void handle_cec_event(struct hdmi_cec_device *dev, const hdmi_cec_event_t
     }
 }
 
-static void *process_thread(void *dev) {
-    while (sunxi_hdmi_cec >= 0) {
-        int ret = poll_data(sunxi_hdmi_cec, 100000);
-        if (ret == -1) {
-            usleep(500 * 1000);
-            ALOGW("failed to receive data");
-            continue;
-        } else if (ret == 0) {
-            continue;
-        }
+static void wake_process_thread(hdmi_cec_context_t *ctx, int reason) {
+    if (ctx->process_event_fd < 0) {
+        return;
+    }
 
-        hdmi_cec_event_t event;
-        ret = read(sunxi_hdmi_cec, &event, sizeof(event));
-        if (ret <= 0) {
-            ALOGW("invalid data receeived: ret=%d msg_len=%d", ret, event.msg_len);
-            continue;
+    __sync_fetch_and_or(&ctx->process_wake_reasons, reason);
+
+    uint64_t value = 1;
+    if (write(ctx->process_event_fd, &value, sizeof(value)) < 0) {
+        ALOGW("wake_process_thread: reason=%d failed=%d", reason, errno);
+    }
+}
+
+static int watch_fd(hdmi_cec_context_t *ctx, int fd, int watch) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    int ret = epoll_ctl(ctx->process_epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev);
+    if (ret < 0 && errno != EEXIST && errno != ENOENT) {
+        ALOGW("watch_fd: fd=%d watch=%d failed=%d", fd, watch, errno);
+        return -errno;
+    }
+    return 0;
+}
+
+// An error on the device can be transient, it is left out of epoll for a
+// backoff that doubles while the errors go on, then watched again
+static void suspend_device(hdmi_cec_context_t *ctx) {
+    watch_fd(ctx, ctx->transport.fd, 0);
+    if (!ctx->device_retry_ms) {
+        ctx->device_retry_ms = CEC_DEVICE_RETRY_MS;
+    } else if (ctx->device_retry_ms < CEC_DEVICE_RETRY_MAX_MS) {
+        ctx->device_retry_ms = ctx->device_retry_ms * 2 < CEC_DEVICE_RETRY_MAX_MS ?
+                               ctx->device_retry_ms * 2 : CEC_DEVICE_RETRY_MAX_MS;
+    }
+    arm_timer(ctx->device_timer_fd, ctx->device_retry_ms);
+}
+
+static void resume_device(hdmi_cec_context_t *ctx) {
+    arm_timer(ctx->device_timer_fd, 0);
+    watch_fd(ctx, ctx->transport.fd, 1);
+}
+
+static int handle_wakeup(hdmi_cec_context_t *ctx) {
+    uint64_t value;
+    if (read(ctx->process_event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        ALOGW("handle_wakeup: read failed=%d", errno);
+    }
+
+    int reasons = __sync_lock_test_and_set(&ctx->process_wake_reasons, 0);
+    if (reasons & PROCESS_WAKE_SHUTDOWN) {
+        return 0;
+    }
+
+    if (reasons & PROCESS_WAKE_RECONFIGURE) {
+        // the device could have been dropped after an error, re-arm it
+        resume_device(ctx);
+    }
+
+    if (reasons & PROCESS_WAKE_TOPOLOGY) {
+        deliver_topology_replies(ctx);
+    }
+
+    if (reasons & PROCESS_WAKE_HOTPLUG) {
+        hotplug_changed(ctx, ctx->hotplug_input);
+    }
+    return 1;
+}
+
+static int open_capture_file(void) {
+    char path[CONFIG_VALUE_MAX];
+    if (!get_config_string("capture_file", path, NULL) || !path[0]) {
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ALOGW("open_capture_file: unable to open %s: %d", path, errno);
+        return -1;
+    }
+
+    cec_capture_header_t header = {
+        .magic = CEC_CAPTURE_MAGIC,
+        .version = CEC_CAPTURE_VERSION,
+        .record_size = sizeof(cec_capture_record_t),
+    };
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        ALOGW("open_capture_file: unable to write %s: %d", path, errno);
+        close(fd);
+        return -1;
+    }
+    ALOGI("open_capture_file: capturing to %s", path);
+    return fd;
+}
+
+// Written before the event is handled, so the capture ends with the event
+// that took the HAL down. A link change records the address it left us.
+static void capture_event(hdmi_cec_context_t *ctx, const hdmi_cec_event_t *event, int64_t timestamp_ns) {
+    cec_capture_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp_ns = timestamp_ns;
+    record.physical_address = 0xffff;
+    record.logical_address_mask = __atomic_load_n(&ctx->logical_address_mask, __ATOMIC_ACQUIRE);
+    record.event_type = event->event_type;
+    record.length = event->msg_len > 0 ? (event->msg_len < (int) sizeof(record.msg) ?
+                                          event->msg_len : (int) sizeof(record.msg)) : 0;
+    memcpy(record.msg, event->msg, record.length);
+
+    int address = __atomic_load_n(&ctx->cached_physical_address, __ATOMIC_ACQUIRE);
+    if (event->event_type == MESSAGE_TYPE_CONNECTED || event->event_type == MESSAGE_TYPE_DISCONNECTED) {
+        uint16_t current = 0xffff;
+        address = ctx->transport.ops->get_physical_address(&ctx->transport, &current) == 0 ? current : -1;
+    }
+    if (address >= 0) {
+        record.physical_address = address;
+    }
+
+    if (write(ctx->capture_fd, &record, sizeof(record)) != sizeof(record)) {
+        ALOGW("capture_event: write failed=%d, capture stopped", errno);
+        close(ctx->capture_fd);
+        ctx->capture_fd = -1;
+    }
+}
+
+static void *process_thread(void *arg) {
+    hdmi_cec_context_t *ctx = arg;
+    struct hdmi_cec_device *dev = &ctx->device;
+
+    for (;;) {
+        struct epoll_event events[4];
+        int count = epoll_wait(ctx->process_epoll_fd, events, 4, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("process_thread: epoll_wait failed=%d", errno);
+            break;
         }
 
-        handle_cec_event(dev, &event);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.fd == ctx->process_event_fd) {
+                if (!handle_wakeup(ctx)) {
+                    return NULL;
+                }
+                continue;
+            }
+
+            if (events[i].data.fd == ctx->key_timer_fd) {
+                uint64_t expirations;
+                if (read(ctx->key_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    ALOGV("process_thread: no repeat for key=%d, releasing", ctx->pressed_key);
+                    release_key(ctx);
+                }
+                continue;
+            }
+
+            if (events[i].data.fd == ctx->hotplug_timer_fd) {
+                uint64_t expirations;
+                if (read(ctx->hotplug_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    commit_hotplug(ctx);
+                }
+                continue;
+            }
+
+            if (events[i].data.fd == ctx->trace_trigger_fd) {
+                handle_trace_trigger(ctx);
+                continue;
+            }
+
+            if (events[i].data.fd == ctx->device_timer_fd) {
+                uint64_t expirations;
+                if (read(ctx->device_timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    ALOGV("process_thread: watching the device again");
+                    resume_device(ctx);
+                }
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                __atomic_fetch_add(&metrics.read_errors, 1, __ATOMIC_RELAXED);
+                suspend_device(ctx);
+                ALOGW("process_thread: device error events=%x, retrying in %dms",
+                      events[i].events, ctx->device_retry_ms);
+                continue;
+            }
+
+            hdmi_cec_event_t event;
+            int64_t timestamp = 0;
+            int ret = ctx->transport.ops->read_event(&ctx->transport, &event, &timestamp);
+            if (ret == -EAGAIN) {
+                continue;
+            } else if (ret == -ENODEV) {
+                __atomic_fetch_add(&metrics.read_errors, 1, __ATOMIC_RELAXED);
+                suspend_device(ctx);
+                ALOGW("process_thread: device gone, retrying in %dms", ctx->device_retry_ms);
+                continue;
+            } else if (ret < 0) {
+                ALOGW("invalid data receeived: ret=%d", ret);
+                __atomic_fetch_add(&metrics.read_errors, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            ctx->device_retry_ms = 0;
+
+            int64_t now = monotonic_ns();
+            if (timestamp) {
+                histogram_add(&metrics.read_latency, now - timestamp);
+            } else {
+                timestamp = now;
+            }
+
+            if (event.event_type == MESSAGE_TYPE_RECEIVE_SUCCESS && event.msg_len >= 1) {
+                note_bus_activity(0, timestamp);
+                ctx->rx_timestamp_ns = timestamp;
+                trace_frame(CEC_TRACE_RX, 0, 0, event.msg, event.msg_len);
+                count_message(metrics.rx_opcodes, &metrics.rx_polls, event.msg + 1, event.msg_len - 1);
+            } else {
+                trace_frame(CEC_TRACE_DEVICE_EVENT, event.event_type, 0, NULL, 0);
+            }
+
+            if (ctx->capture_fd >= 0) {
+                capture_event(ctx, &event, timestamp);
+            }
+            handle_cec_event(dev, &event);
+            __atomic_fetch_add(&metrics.rx_events, 1, __ATOMIC_RELEASE);
+        }
     }
     return NULL;
 }
 
 static int enable_hdmi_cec(const struct hdmi_cec_device *dev) {
-    if (enabled) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE)) {
+        // the framework enabling again is a hint the device might be back
         ALOGV("enable_hdmi_cec: is already enabled");
+        wake_process_thread(ctx, PROCESS_WAKE_RECONFIGURE);
         return 0;
     }
-    int ret = ioctl(sunxi_hdmi_cec, HDMICEC_IOC_STARTDEVICE, NULL);
+    int ret = ctx->transport.ops->start(&ctx->transport);
     if (ret < 0) {
         ALOGW("enable_hdmi_cec: failed=%d", ret);
     } else {
         ALOGV("enable_hdmi_cec: enabled");
-        enabled = 1;
+        __atomic_store_n(&ctx->enabled, 1, __ATOMIC_RELEASE);
+        wake_process_thread(ctx, PROCESS_WAKE_RECONFIGURE);
     }
     return ret;
 }
 
 static int disable_hdmi_cec(const struct hdmi_cec_device *dev) {
-    if (!enabled) {
+    hdmi_cec_context_t *ctx = context_of(dev);
+    if (!__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE)) {
         ALOGV("disable_hdmi_cec: is already disabled");
         return 0;
     }
-    int ret = ioctl(sunxi_hdmi_cec, HDMICEC_IOC_STOPDEVICE, NULL);
+    int ret = ctx->transport.ops->stop(&ctx->transport);
     if (ret < 0) {
         ALOGW("disable_hdmi_cec: failed=%d", ret);
     } else {
         ALOGV("disable_hdmi_cec: disabled");
-        enabled = 0;
+        __atomic_store_n(&ctx->enabled, 0, __ATOMIC_RELEASE);
     }
     return ret;
 }
 
-static int open_hdmi_cec(struct hdmi_cec_device *dev) {
-    if (sunxi_hdmi_cec >= 0) {
-        ALOGV("open_hdmi_cec: is opened fd=%d", sunxi_hdmi_cec);
-        return 0;
+static void close_process_fds(hdmi_cec_context_t *ctx) {
+    if (ctx->process_epoll_fd >= 0) {
+        close(ctx->process_epoll_fd);
+        ctx->process_epoll_fd = -1;
+    }
+    if (ctx->process_event_fd >= 0) {
+        close(ctx->process_event_fd);
+        ctx->process_event_fd = -1;
+    }
+    if (ctx->hotplug_timer_fd >= 0) {
+        close(ctx->hotplug_timer_fd);
+        ctx->hotplug_timer_fd = -1;
+    }
+    if (ctx->device_timer_fd >= 0) {
+        close(ctx->device_timer_fd);
+        ctx->device_timer_fd = -1;
+    }
+    if (ctx->capture_fd >= 0) {
+        close(ctx->capture_fd);
+        ctx->capture_fd = -1;
     }
+    if (ctx->trace_trigger_fd >= 0) {
+        close(ctx->trace_trigger_fd);
+        ctx->trace_trigger_fd = -1;
+    }
+}
 
-    sunxi_hdmi_cec = open(CEC_SUNXI_PATH, O_RDWR);
-    if (sunxi_hdmi_cec < 0) {
-        ALOGE("open_hdmi_cec: unable to open device=%d", errno);
-        return -1;
+static const cec_transport_ops_t *find_transport(void) {
+    static const cec_transport_ops_t *transports[] = {
+        &sunxi_cec_transport_ops,
+        &linux_cec_transport_ops,
+#ifdef SUNXI_HDMI_CEC_FAKE
+        // only built into the test tools, never into the module
+        &fake_cec_transport_ops,
+#endif // SUNXI_HDMI_CEC_FAKE
+    };
+    char name[CONFIG_VALUE_MAX];
+    get_config_string("transport", name, sunxi_cec_transport_ops.name);
+
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+        if (!strcmp(transports[i]->name, name)) {
+            return transports[i];
+        }
     }
 
-    int ret = pthread_create(&process_thread_handle, NULL, process_thread, dev);
+    ALOGW("find_transport: unknown transport=%s, using %s", name, sunxi_cec_transport_ops.name);
+    return &sunxi_cec_transport_ops;
+}
+
+static int open_hdmi_cec(hdmi_cec_context_t *ctx) {
+    ctx->transport.ops = find_transport();
+    int ret = ctx->transport.ops->open(&ctx->transport);
     if (ret < 0) {
+        ALOGE("open_hdmi_cec: unable to open %s device=%d", ctx->transport.ops->name, ret);
+        return -1;
+    }
+
+    load_retry_policy(ctx);
+    load_opcode_handlers();
+    load_dedup_policy();
+    trace_enabled = get_config_int("trace", 1);
+    topology_ttl_ms = get_config_int("topology_ttl_ms", TOPOLOGY_DEFAULT_TTL_MS);
+    discovery_enabled = get_config_int("discovery", 1);
+    tx_async = get_config_int("async_tx", 0);
+    topology_reset();
+    ctx->capture_fd = open_capture_file();
+    ctx->trace_trigger_fd = open_trace_trigger(ctx);
+    // until the first hotplug, a valid physical address is the best guess
+    refresh_physical_address(ctx);
+    ctx->connected = ctx->cached_physical_address >= 0 && ctx->cached_physical_address != 0xffff;
+    ctx->hotplug_input = ctx->connected;
+    ctx->hotplug_committed = -1;
+    ctx->hotplug_reported = -1;
+    ctx->hotplug_debounce_ms = get_config_int("hotplug_debounce_ms", CEC_HOTPLUG_DEBOUNCE_MS);
+
+    ctx->process_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->process_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ctx->hotplug_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ctx->device_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctx->process_epoll_fd < 0 || ctx->process_event_fd < 0 || ctx->hotplug_timer_fd < 0 ||
+        ctx->device_timer_fd < 0 ||
+        watch_fd(ctx, ctx->process_event_fd, 1) < 0 || watch_fd(ctx, ctx->transport.fd, 1) < 0 ||
+        watch_fd(ctx, ctx->hotplug_timer_fd, 1) < 0 || watch_fd(ctx, ctx->device_timer_fd, 1) < 0 ||
+        (ctx->trace_trigger_fd >= 0 && watch_fd(ctx, ctx->trace_trigger_fd, 1) < 0)) {
+        ALOGE("open_hdmi_cec: unable to setup epoll=%d", errno);
+        close_process_fds(ctx);
+        ctx->transport.ops->close(&ctx->transport);
+        return -1;
+    }
+
+    if (get_config_int("uinput", 0)) {
+        load_keymap();
+        ret = open_uinput(ctx);
+        if (ret < 0 || watch_fd(ctx, ctx->key_timer_fd, 1) < 0) {
+            ALOGW("open_hdmi_cec: remote keys go to the framework, uinput failed=%d", ret);
+            close_uinput(ctx);
+        }
+    }
+
+    if (start_dispatch_thread(ctx) < 0) {
+        close_uinput(ctx);
+        close_process_fds(ctx);
+        ctx->transport.ops->close(&ctx->transport);
+        return -1;
+    }
+
+    // process_thread queues its replies from the first frame on
+    if (start_tx_thread(ctx) < 0) {
+        stop_dispatch_thread();
+        close_uinput(ctx);
+        close_process_fds(ctx);
+        ctx->transport.ops->close(&ctx->transport);
+        return -1;
+    }
+
+    ret = pthread_create(&ctx->process_thread, NULL, process_thread, ctx);
+    if (ret != 0) {
         ALOGE("open_hdmi_cec: unable to start thread=%d", ret);
-        close(sunxi_hdmi_cec);
-        sunxi_hdmi_cec = -1;
+        stop_tx_thread();
+        stop_dispatch_thread();
+        close_uinput(ctx);
+        close_process_fds(ctx);
+        ctx->transport.ops->close(&ctx->transport);
         return -1;
     }
 
-    ALOGV("open_hdmi_cec: opened fd=%d", sunxi_hdmi_cec);
+    ALOGV("open_hdmi_cec: opened transport=%s fd=%d async_tx=%d",
+          ctx->transport.ops->name, ctx->transport.fd, tx_async);
     return 0;
 }
 
 static int close_hdmi_cec(struct hdmi_cec_device *dev) {
-    if (sunxi_hdmi_cec < 0) {
-        ALOGV("close_hdmi_cec: is closed");
+    hdmi_cec_context_t *ctx = context_of(dev);
+
+    pthread_mutex_lock(&context_lock);
+    if (--ctx->refcount > 0) {
+        ALOGV("close_hdmi_cec: still opened refcount=%d", ctx->refcount);
+        pthread_mutex_unlock(&context_lock);
         return 0;
     }
+    __atomic_store_n(&context, NULL, __ATOMIC_RELEASE);
 
-    ALOGV("close_hdmi_cec: fd=%d", sunxi_hdmi_cec);
+    ALOGV("close_hdmi_cec: fd=%d", ctx->transport.fd);
+
+    // stop the reader and writer before the fd goes away, so they never use a closed descriptor
+    stop_tx_thread();
+    wake_process_thread(ctx, PROCESS_WAKE_SHUTDOWN);
+    pthread_join(ctx->process_thread, NULL);
+    stop_dispatch_thread();
+    close_uinput(ctx);
+
+    write_dump_files();
 
     disable_hdmi_cec(dev);
-    close(sunxi_hdmi_cec);
-    sunxi_hdmi_cec = -1;
+    close_process_fds(ctx);
+    ctx->transport.ops->close(&ctx->transport);
+    pthread_mutex_unlock(&context_lock);
 
-    pthread_join(process_thread_handle, NULL);
-    process_thread_handle = 0;
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
     return 0;
 }
 
 static int set_hdmi_cec_wake_up(const struct hdmi_cec_device *dev, unsigned char enabled) {
-    int ret = ioctl(sunxi_hdmi_cec, HDMICEC_IOC_SETWAKEUP, enabled);
+    hdmi_cec_context_t *ctx = context_of(dev);
+    int ret = ctx->transport.ops->set_wakeup(&ctx->transport, enabled);
     if (ret < 0) {
         ALOGW("set_hdmi_cec_wake_up: enabled=%d failed=%d", enabled, ret);
     } else {
@@ -423,7 +3172,11 @@ static void set_option(struct hdmi_cec_device *dev, int flag, int value) {
             break;
 
         case HDMI_OPTION_SYSTEM_CEC_CONTROL:
-            system_control = value;
+            __atomic_store_n(&context_of(dev)->system_control, value, __ATOMIC_RELEASE);
+            if (value) {
+                // hotplugs seen without control were not reported
+                wake_process_thread(context_of(dev), PROCESS_WAKE_HOTPLUG);
+            }
             break;
 
         default:
@@ -436,13 +3189,43 @@ static int open_hw_module(const struct hw_module_t *module, char const *name,
                          struct hw_device_t **device) {
     ALOGV("open_hw_module");
 
-    hdmi_cec_device_t *dev = (hdmi_cec_device_t *) malloc(sizeof(hdmi_cec_device_t));
-    if (dev == NULL) {
+    pthread_mutex_lock(&context_lock);
+    hdmi_cec_context_t *ctx = context;
+    if (ctx) {
+        ctx->refcount++;
+        pthread_mutex_unlock(&context_lock);
+        *device = (struct hw_device_t *) &ctx->device;
+        ALOGV("open_hw_module: shared refcount=%d", ctx->refcount);
+        return 0;
+    }
+
+    ctx = (hdmi_cec_context_t *) calloc(1, sizeof(hdmi_cec_context_t));
+    if (ctx == NULL) {
+        pthread_mutex_unlock(&context_lock);
         ALOGE("failed to allocate");
         return -1;
     }
 
-    memset(dev, 0, sizeof(*dev));
+    ctx->refcount = 1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->transport.fd = -1;
+    ctx->logical_address = CEC_DEVICE_INACTIVE;
+    ctx->driver_logical_address = -1;
+    ctx->cached_physical_address = -1;
+    ctx->port_info.type = HDMI_OUTPUT;
+    ctx->port_info.port_id = 0;
+    ctx->port_info.cec_supported = 1;
+    ctx->port_info.arc_supported = 0;
+    ctx->process_epoll_fd = -1;
+    ctx->process_event_fd = -1;
+    ctx->uinput_fd = -1;
+    ctx->key_timer_fd = -1;
+    ctx->hotplug_timer_fd = -1;
+    ctx->device_timer_fd = -1;
+    ctx->capture_fd = -1;
+    ctx->trace_trigger_fd = -1;
+
+    hdmi_cec_device_t *dev = &ctx->device;
     dev->common.tag = HARDWARE_DEVICE_TAG;
     dev->common.version = 0;
     dev->common.module = (struct hw_module_t *) module;
@@ -459,10 +3242,12 @@ static int open_hw_module(const struct hw_module_t *module, char const *name,
     dev->set_audio_return_channel = set_audio_return_channel;
     dev->is_connected = is_connected;
 
-    int ret = open_hdmi_cec(dev);
+    int ret = open_hdmi_cec(ctx);
     if (ret < 0) {
+        pthread_mutex_unlock(&context_lock);
         ALOGE("open_hw_module: failed: %d", ret);
-        free(dev);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
         return ret;
     }
 
@@ -470,6 +3255,9 @@ static int open_hw_module(const struct hw_module_t *module, char const *name,
 
     set_hdmi_cec_wake_up(dev, 1);
 
+    __atomic_store_n(&context, ctx, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&context_lock);
+
     *device = (struct hw_device_t *) dev;
 
     ALOGV("open_hw_module: success");
@@ -0,0 +1,45 @@
+#ifndef __SUNXI_HDMI_CEC_H__
+#define __SUNXI_HDMI_CEC_H__
+
+// Diagnostics exported by the HAL for the test and benchmark binaries,
+// which link sunxi_hdmi_cec.c directly.
+
+typedef struct sunxi_hdmi_cec_rx_stats {
+    unsigned int size;
+    unsigned int pending;
+    unsigned int dispatched;
+    unsigned int overflows;
+    unsigned int high_water;
+} sunxi_hdmi_cec_rx_stats_t;
+
+void sunxi_hdmi_cec_get_rx_stats(sunxi_hdmi_cec_rx_stats_t *stats);
+
+// number of device events process_thread has handled, including link changes
+unsigned int sunxi_hdmi_cec_get_event_count(void);
+
+// number of times the HAL answered the opcode without the framework
+unsigned int sunxi_hdmi_cec_get_response_count(int opcode);
+
+// number of repeated frames of the opcode kept from the framework, see dedup_windows
+unsigned int sunxi_hdmi_cec_get_suppressed_count(int opcode);
+
+// number of automatic replies of the opcode dropped because the TX queue was
+// full, their requests went to the framework instead
+unsigned int sunxi_hdmi_cec_get_dropped_count(int opcode);
+
+// Writes per-opcode counters, transmit results and latency histograms as
+// text. The same dump goes to persist.cec.metrics_file when the device closes.
+void sunxi_hdmi_cec_dump_metrics(int fd);
+
+// Writes what the HAL learned about the other devices on the bus, one
+// line per logical address, see topology_ttl_ms. Also written to
+// persist.cec.topology_file when the device closes.
+void sunxi_hdmi_cec_dump_topology(int fd);
+
+// Writes the flight recorder ring in the sunxi_hdmi_cec_trace.h format,
+// decode it with hdmi_cec.tracedump. Also written to persist.cec.trace_file
+// when the device closes, and every time the file named by
+// persist.cec.trace_trigger is touched. Returns 0 or -errno.
+int sunxi_hdmi_cec_dump_trace(int fd);
+
+#endif // __SUNXI_HDMI_CEC_H__
@@ -0,0 +1,387 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Offline decoder for the line edges written by hdmi_cec.dump -o, prints
+// every frame seen on the bus with the acknowledge of each block
+//
+//   hdmi_cec.analyze [-q] [-t] edges-file
+//
+// -q only prints the summary. -t checks every bit against the timing a
+// follower must accept, CEC 1.4 section 5.2.2, marks the frames outside
+// it and adds histograms of the measured times and the violations of each
+// device. The file is mapped, so captures of hours decode in about the
+// time it takes to read them.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sunxi_hdmi_cec_decode.h"
+#include "sunxi_hdmi_cec_edges.h"
+#include "sunxi_hdmi_cec_opcodes.h"
+
+#define OUTPUT_BUFFER (256 * 1024)
+
+#define TIMING_BUCKET_US 50
+#define TIMING_BUCKETS 128 // the last one takes everything longer
+#define DEVICE_UNKNOWN 16 // violations of frames whose header was lost
+
+enum {
+    TIMING_START_LOW,
+    TIMING_START_PERIOD,
+    TIMING_BIT0_LOW,
+    TIMING_BIT1_LOW,
+    TIMING_BIT_PERIOD,
+    TIMING_COUNT,
+};
+
+typedef struct timing_limit {
+    const char *name;
+    uint32_t min_us;
+    uint32_t max_us;
+} timing_limit_t;
+
+static const timing_limit_t timing_limits[TIMING_COUNT] = {
+    {"start_low", 3500, 3900},
+    {"start_period", 4300, 4700},
+    {"bit0_low", 1300, 1700},
+    {"bit1_low", 400, 800},
+    {"bit_period", 2050, 2750},
+};
+
+typedef struct timing_histogram {
+    unsigned long long count;
+    unsigned long long total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    unsigned int violations;
+    unsigned int buckets[TIMING_BUCKETS];
+} timing_histogram_t;
+
+typedef struct device_stats {
+    unsigned int frames; // initiated
+    unsigned int flagged; // initiated and outside the timing
+    unsigned int violations; // bits the device drove outside the timing
+} device_stats_t;
+
+typedef struct analysis {
+    uint64_t start_ns;
+    int quiet;
+    int timing;
+    uint32_t margin_us; // the sampling period, how far off a measured time can be
+    uint32_t start_margin_us; // the idle period too for triggered captures, start bits are stamped at it
+    unsigned int flagged;
+    timing_histogram_t histograms[TIMING_COUNT];
+    device_stats_t devices[DEVICE_UNKNOWN + 1];
+    unsigned long long edges;
+    unsigned int lost;
+    unsigned int frames;
+    unsigned int polls;
+    unsigned int nacked;
+    unsigned int errors[4]; // by CEC_FRAME_* bit
+} analysis_t;
+
+// A for every block some follower acknowledged. Directed frames are
+// acknowledged by pulling the ACK bit low, broadcasts are rejected that way.
+static int format_acks(const cec_frame_t *frame, char *buffer) {
+    int broadcast = (frame->data[0] & 0x0f) == 0x0f;
+    int nacked = 0;
+
+    for (int i = 0; i < frame->length; i++) {
+        int ack = ((frame->ack >> i) & 1) == broadcast;
+        buffer[i] = ack ? 'A' : 'N';
+        nacked |= !ack;
+    }
+    buffer[frame->length] = 0;
+    return nacked;
+}
+
+static uint32_t timing_margin(const analysis_t *analysis, int measure) {
+    if (measure == TIMING_START_LOW || measure == TIMING_START_PERIOD) {
+        return analysis->start_margin_us;
+    }
+    return analysis->margin_us;
+}
+
+static int add_timing(analysis_t *analysis, int measure, uint32_t us, int device, int bit,
+                      char *note, size_t size) {
+    const timing_limit_t *limit = &timing_limits[measure];
+    timing_histogram_t *histogram = &analysis->histograms[measure];
+    uint32_t margin_us = timing_margin(analysis, measure);
+    int bucket = us / TIMING_BUCKET_US;
+
+    histogram->buckets[bucket < TIMING_BUCKETS ? bucket : TIMING_BUCKETS - 1]++;
+    if (!histogram->count || us < histogram->min_us) {
+        histogram->min_us = us;
+    }
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+    histogram->count++;
+    histogram->total_us += us;
+
+    if (us + margin_us >= limit->min_us && us <= limit->max_us + margin_us) {
+        return 0;
+    }
+
+    histogram->violations++;
+    analysis->devices[device].violations++;
+    if (!note[0]) {
+        if (bit < 0) {
+            snprintf(note, size, "%s=%uus@S", limit->name, us);
+        } else {
+            snprintf(note, size, "%s=%uus@%d", limit->name, us, bit);
+        }
+    }
+    return 1;
+}
+
+// The initiator drives every bit except the low of an acknowledged ACK
+// bit, which the follower stretches. Returns the number of violations and
+// describes the first one in note.
+static int check_timing(analysis_t *analysis, const cec_frame_t *frame, char *note, size_t size) {
+    int initiator = frame->length >= 1 ? frame->data[0] >> 4 : DEVICE_UNKNOWN;
+    int destination = frame->length >= 1 ? frame->data[0] & 0x0f : DEVICE_UNKNOWN;
+    int violations = 0;
+
+    note[0] = 0;
+    violations += add_timing(analysis, TIMING_START_LOW, frame->start_bit.low_us, initiator, -1, note, size);
+    if (frame->start_bit.period_us) {
+        violations += add_timing(analysis, TIMING_START_PERIOD, frame->start_bit.period_us, initiator, -1, note, size);
+    }
+
+    for (int i = 0; i < frame->bit_count; i++) {
+        const cec_bit_timing_t *bit = &frame->bits[i];
+        int value = cec_frame_bit(frame, i);
+        int driver = initiator;
+        if (i % 10 == 9 && !value) {
+            // a rejected broadcast does not say who rejected it
+            driver = destination == 0x0f ? DEVICE_UNKNOWN : destination;
+        }
+
+        violations += add_timing(analysis, value ? TIMING_BIT1_LOW : TIMING_BIT0_LOW, bit->low_us, driver, i, note, size);
+        if (bit->period_us) {
+            violations += add_timing(analysis, TIMING_BIT_PERIOD, bit->period_us, initiator, i, note, size);
+        }
+    }
+
+    analysis->devices[initiator].frames++;
+    if (violations) {
+        analysis->devices[initiator].flagged++;
+        analysis->flagged++;
+    }
+    return violations;
+}
+
+static void print_timing(const analysis_t *analysis) {
+    printf("# timing margin_us=%u start_margin_us=%u flagged=%u\n", analysis->margin_us,
+           analysis->start_margin_us, analysis->flagged);
+
+    for (int measure = 0; measure < TIMING_COUNT; measure++) {
+        const timing_limit_t *limit = &timing_limits[measure];
+        const timing_histogram_t *histogram = &analysis->histograms[measure];
+        uint32_t margin_us = timing_margin(analysis, measure);
+        printf("# %s_us count=%llu min=%u avg=%.1f max=%u limits=%u-%u violations=%u\n",
+               limit->name, histogram->count, histogram->min_us,
+               histogram->count ? (double) histogram->total_us / histogram->count : 0.0,
+               histogram->max_us, limit->min_us, limit->max_us, histogram->violations);
+
+        for (int bucket = 0; bucket < TIMING_BUCKETS; bucket++) {
+            if (!histogram->buckets[bucket]) {
+                continue;
+            }
+            uint32_t from_us = bucket * TIMING_BUCKET_US;
+            uint32_t to_us = from_us + TIMING_BUCKET_US - 1;
+            int outside = to_us + margin_us < limit->min_us || from_us > limit->max_us + margin_us;
+            if (bucket == TIMING_BUCKETS - 1) {
+                printf("#   %5u-      %u%s\n", from_us, histogram->buckets[bucket], outside ? " out" : "");
+            } else {
+                printf("#   %5u-%5u %u%s\n", from_us, to_us, histogram->buckets[bucket], outside ? " out" : "");
+            }
+        }
+    }
+
+    for (int device = 0; device <= DEVICE_UNKNOWN; device++) {
+        const device_stats_t *stats = &analysis->devices[device];
+        if (!stats->frames && !stats->violations) {
+            continue;
+        }
+        if (device == DEVICE_UNKNOWN) {
+            printf("# device ? frames=%u flagged=%u violations=%u\n", stats->frames, stats->flagged, stats->violations);
+        } else {
+            printf("# device %x frames=%u flagged=%u violations=%u\n", device, stats->frames, stats->flagged, stats->violations);
+        }
+    }
+}
+
+static void print_frame(const cec_frame_t *frame, void *arg) {
+    analysis_t *analysis = arg;
+    unsigned long long ts_us = (frame->start_ns - analysis->start_ns) / 1000;
+    const char *error = cec_frame_error(frame->flags);
+    char acks[CEC_FRAME_MAX_BLOCKS + 1];
+    char note[64];
+    int violations = 0;
+
+    analysis->frames++;
+    if (analysis->timing) {
+        violations = check_timing(analysis, frame, note, sizeof(note));
+    }
+    int nacked = format_acks(frame, acks);
+    if (!error && frame->length == 1) {
+        analysis->polls++;
+    }
+    if (!error && nacked) {
+        analysis->nacked++;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (frame->flags & (1 << i)) {
+            analysis->errors[i]++;
+        }
+    }
+    if (analysis->quiet) {
+        return;
+    }
+
+    printf("%6llu.%06llu", ts_us / 1000000, ts_us % 1000000);
+    if (frame->length >= 1) {
+        printf(" %x->%x", frame->data[0] >> 4, frame->data[0] & 0x0f);
+    } else {
+        printf(" ?->?");
+    }
+    if (frame->length >= 2) {
+        printf(" %-26s", cec_opcode_name(frame->data[1]));
+    } else if (frame->length == 1) {
+        printf(" %-26s", "POLL");
+    } else {
+        printf(" %-26s", "");
+    }
+
+    for (int i = 0; i < frame->length; i++) {
+        printf(" %02x", frame->data[i]);
+    }
+    printf(" ack=%s", acks);
+    if (error) {
+        printf(" error=%s bits=%d", error, frame->bit_count);
+    }
+    if (violations) {
+        printf(" timing=%d %s", violations, note);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    analysis_t analysis;
+    int opt;
+
+    memset(&analysis, 0, sizeof(analysis));
+    while ((opt = getopt(argc, argv, "qt")) != -1) {
+        switch (opt) {
+            case 'q': analysis.quiet = 1; break;
+            case 't': analysis.timing = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-q] [-t] edges-file\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-q] [-t] edges-file\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open edges");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(cec_edges_header_t)) {
+        fprintf(stderr, "Not a CEC edge capture\n");
+        return 1;
+    }
+    size_t size = st.st_size;
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map edges");
+        return 1;
+    }
+    close(fd);
+    madvise((void *) map, size, MADV_SEQUENTIAL);
+
+    const cec_edges_header_t *header = (const cec_edges_header_t *) map;
+    if (header->magic != CEC_EDGES_MAGIC || header->version != CEC_EDGES_VERSION) {
+        fprintf(stderr, "Not a CEC edge capture\n");
+        return 1;
+    }
+    if (header->record_size != sizeof(uint16_t)) {
+        fprintf(stderr, "Unsupported record size: %u\n", header->record_size);
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
+
+    cec_decoder_t decoder;
+    cec_decoder_init(&decoder, print_frame, &analysis);
+    analysis.start_ns = header->start_ns;
+    analysis.margin_us = header->period_us;
+    analysis.start_margin_us = header->period_us > header->idle_period_us ? header->period_us : header->idle_period_us;
+
+    const uint16_t *records = (const uint16_t *) (map + sizeof(*header));
+    size_t count = (size - sizeof(*header)) / sizeof(uint16_t);
+    uint64_t timestamp_ns = header->start_ns;
+    size_t index = 0;
+    int level, ret;
+    uint32_t delta_us;
+    while ((ret = cec_edge_read(records, count, &index, &level, &delta_us)) >= 0) {
+        if (ret == 0) {
+            analysis.lost++;
+            cec_decoder_lost(&decoder);
+            continue;
+        }
+        timestamp_ns += delta_us * 1000ULL;
+        cec_decoder_edge(&decoder, level, timestamp_ns);
+        analysis.edges++;
+    }
+    cec_decoder_idle(&decoder, UINT64_MAX / 2);
+    cec_decoder_abort(&decoder, CEC_FRAME_TRUNCATED);
+
+    unsigned long long duration_us = (timestamp_ns - header->start_ns) / 1000;
+    printf("# edges=%llu lost=%u duration_s=%llu.%06llu period_us=%u\n", analysis.edges, analysis.lost,
+           duration_us / 1000000, duration_us % 1000000, header->period_us);
+    printf("# frames=%u polls=%u nacked=%u truncated=%u bad_bit=%u too_long=%u edges_lost=%u\n",
+           analysis.frames, analysis.polls, analysis.nacked, analysis.errors[0], analysis.errors[1],
+           analysis.errors[2], analysis.errors[3]);
+    if (analysis.timing) {
+        print_timing(&analysis);
+    }
+
+    munmap((void *) map, size);
+    return 0;
+}
@@ -0,0 +1,383 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Throughput and latency benchmark for the HAL, driven through
+// HAL_MODULE_INFO_SYM against the fake transport. Every scenario prints
+// one JSON object per line, so results can be compared between builds.
+//
+//   hdmi_cec.bench [-n messages] [-r rate] [-b bit_time_us] [-a] [-s scenario] [-l p99_limit_us]
+
+#define LOG_TAG "bench"
+
+#include <hardware/hdmi_cec.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "log.h"
+#include "sunxi_hdmi_cec.h"
+#include "sunxi_hdmi_cec_fake.h"
+
+extern struct hw_module_t HAL_MODULE_INFO_SYM;
+
+#define ME CEC_ADDR_PLAYBACK_1
+#define TV CEC_ADDR_TV
+#define PROBE_MAGIC 'B'
+#define DRAIN_TIMEOUT_NS 5000000000LL
+#define RX_WINDOW 32 // half of the HAL dispatch ring
+
+typedef struct samples {
+    int64_t *start_ns;
+    int64_t *done_ns;
+    unsigned int count;
+    unsigned int done;
+} samples_t;
+
+static samples_t probes;
+static sunxi_hdmi_cec_rx_stats_t rx_stats_start;
+static int p99_limit_us = 0;
+static int failed = 0;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts = {deadline_ns / 1000000000LL, deadline_ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void reset_samples(unsigned int count)
+{
+    free(probes.start_ns);
+    free(probes.done_ns);
+    probes.start_ns = calloc(count, sizeof(int64_t));
+    probes.done_ns = calloc(count, sizeof(int64_t));
+    probes.count = count;
+    __atomic_store_n(&probes.done, 0, __ATOMIC_SEQ_CST);
+    sunxi_hdmi_cec_get_rx_stats(&rx_stats_start);
+}
+
+// probes are vendor commands carrying a sequence number
+static int build_probe(unsigned char *body, unsigned int sequence)
+{
+    body[0] = CEC_MESSAGE_VENDOR_COMMAND;
+    body[1] = PROBE_MAGIC;
+    body[2] = sequence >> 24;
+    body[3] = sequence >> 16;
+    body[4] = sequence >> 8;
+    body[5] = sequence;
+    return 6;
+}
+
+static int parse_probe(const unsigned char *body, size_t length, unsigned int *sequence)
+{
+    if (length < 6 || body[0] != CEC_MESSAGE_VENDOR_COMMAND || body[1] != PROBE_MAGIC) {
+        return 0;
+    }
+    *sequence = (body[2] << 24) | (body[3] << 16) | (body[4] << 8) | body[5];
+    return *sequence < probes.count;
+}
+
+static void complete_probe(unsigned int sequence)
+{
+    if (!probes.done_ns[sequence]) {
+        probes.done_ns[sequence] = now_ns();
+        __atomic_fetch_add(&probes.done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void callback(const hdmi_event_t *event, void *arg)
+{
+    unsigned int sequence;
+    if (event->type == HDMI_EVENT_CEC_MESSAGE &&
+        parse_probe(event->cec.body, event->cec.length, &sequence)) {
+        complete_probe(sequence);
+    }
+}
+
+static void tx_hook(const unsigned char *frame, size_t length, int result, void *arg)
+{
+    unsigned int sequence;
+    if (result == 0 && length > 1 && parse_probe(frame + 1, length - 1, &sequence)) {
+        complete_probe(sequence);
+    }
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *sorted, unsigned int count, double p)
+{
+    if (count == 0) {
+        return 0;
+    }
+    unsigned int index = (unsigned int) (p * count + 0.999999);
+    if (index > 0) {
+        index--;
+    }
+    return sorted[index < count ? index : count - 1];
+}
+
+static void wait_for_probes(unsigned int expected)
+{
+    int64_t deadline = now_ns() + DRAIN_TIMEOUT_NS;
+    while (__atomic_load_n(&probes.done, __ATOMIC_ACQUIRE) < expected && now_ns() < deadline) {
+        usleep(1000);
+    }
+}
+
+static void report(const char *scenario, int64_t elapsed_ns, const char *extra)
+{
+    int64_t *latency = malloc(probes.count * sizeof(int64_t));
+    unsigned int count = 0;
+    int64_t last_done = 0;
+
+    for (unsigned int i = 0; i < probes.count; i++) {
+        if (probes.done_ns[i]) {
+            latency[count++] = (probes.done_ns[i] - probes.start_ns[i]) / 1000;
+            if (probes.done_ns[i] > last_done) {
+                last_done = probes.done_ns[i];
+            }
+        }
+    }
+    qsort(latency, count, sizeof(int64_t), compare_int64);
+
+    if (elapsed_ns <= 0 && count) {
+        elapsed_ns = last_done - probes.start_ns[0];
+    }
+
+    sunxi_hdmi_cec_rx_stats_t rx_stats;
+    sunxi_hdmi_cec_get_rx_stats(&rx_stats);
+
+    int64_t p99 = percentile(latency, count, 0.99);
+    printf("{\"scenario\":\"%s\",\"sent\":%u,\"completed\":%u,\"seconds\":%.6f,\"msgs_per_sec\":%.1f,"
+           "\"p50_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld,"
+           "\"rx_overflows\":%u,\"rx_high_water\":%u%s}\n",
+           scenario, probes.count, count, elapsed_ns / 1e9,
+           elapsed_ns > 0 ? count / (elapsed_ns / 1e9) : 0.0,
+           (long long) percentile(latency, count, 0.50), (long long) p99,
+           (long long) percentile(latency, count, 0.999),
+           (long long) (count ? latency[count - 1] : 0),
+           rx_stats.overflows - rx_stats_start.overflows, rx_stats.high_water, extra ? extra : "");
+    fflush(stdout);
+
+    if (count < probes.count || (p99_limit_us && p99 > p99_limit_us)) {
+        failed = 1;
+    }
+    free(latency);
+}
+
+static void inject_probe(unsigned int sequence)
+{
+    unsigned char frame[1 + CEC_MESSAGE_BODY_MAX_LENGTH];
+    frame[0] = (TV << 4) | ME;
+    int length = 1 + build_probe(frame + 1, sequence);
+
+    probes.start_ns[sequence] = now_ns();
+    while (sunxi_hdmi_cec_fake_inject_frame(frame, length) == -ENOSPC) {
+        sched_yield();
+    }
+}
+
+// as fast as the HAL keeps up, with a bounded number of frames in flight
+static void bench_rx_throughput(unsigned int count)
+{
+    reset_samples(count);
+    int64_t start = now_ns();
+    for (unsigned int i = 0; i < count; i++) {
+        while (i - __atomic_load_n(&probes.done, __ATOMIC_ACQUIRE) >= RX_WINDOW) {
+            sched_yield();
+        }
+        inject_probe(i);
+    }
+    wait_for_probes(count);
+    report("rx_throughput", now_ns() - start, NULL);
+}
+
+// paced, to see the latency without queueing in front of it
+static void bench_rx_latency(unsigned int count, int rate)
+{
+    reset_samples(count);
+    int64_t start = now_ns();
+    int64_t interval = 1000000000LL / rate;
+    for (unsigned int i = 0; i < count; i++) {
+        sleep_until(start + i * interval);
+        inject_probe(i);
+    }
+    wait_for_probes(count);
+    report("rx_latency", now_ns() - start, NULL);
+}
+
+static void bench_tx_latency(hdmi_cec_device_t *dev, unsigned int count, const char *scenario, int destination)
+{
+    reset_samples(count);
+    int64_t start = now_ns();
+    for (unsigned int i = 0; i < count; i++) {
+        cec_message_t msg;
+        msg.initiator = ME;
+        msg.destination = destination;
+        msg.length = build_probe(msg.body, i);
+
+        probes.start_ns[i] = now_ns();
+        while (dev->send_message(dev, &msg) == HDMI_RESULT_BUSY) {
+            usleep(100);
+        }
+    }
+    wait_for_probes(count);
+    report(scenario, now_ns() - start, NULL);
+}
+
+// a TV polling us and asking for the power status as fast as it can,
+// with probes mixed in to measure what it does to the normal traffic
+static void bench_polling_storm(unsigned int count)
+{
+    sunxi_hdmi_cec_fake_stats_t before, after;
+    sunxi_hdmi_cec_fake_get_stats(&before);
+    unsigned int responses = sunxi_hdmi_cec_get_response_count(CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS);
+    unsigned int dropped = sunxi_hdmi_cec_get_dropped_count(CEC_MESSAGE_REPORT_POWER_STATUS);
+
+    unsigned int probe_count = count / 10 ? count / 10 : 1;
+    reset_samples(probe_count);
+
+    unsigned char poll[] = {(TV << 4) | ME};
+    unsigned char power[] = {(TV << 4) | ME, CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS};
+
+    int64_t start = now_ns();
+    for (unsigned int i = 0; i < count; i++) {
+        if (i % 10 == 0 && i / 10 < probe_count) {
+            inject_probe(i / 10);
+        } else if (i % 2) {
+            while (sunxi_hdmi_cec_fake_inject_frame(poll, sizeof(poll)) == -ENOSPC) {
+                sched_yield();
+            }
+        } else {
+            while (sunxi_hdmi_cec_fake_inject_frame(power, sizeof(power)) == -ENOSPC) {
+                sched_yield();
+            }
+        }
+    }
+    wait_for_probes(probe_count);
+    int64_t elapsed = now_ns() - start;
+
+    // responses are sent from the reader thread, give the last ones a moment
+    usleep(100000);
+    sunxi_hdmi_cec_fake_get_stats(&after);
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), ",\"storm_frames\":%u,\"responses\":%u,\"dropped\":%u,\"tx_frames\":%u",
+             count, sunxi_hdmi_cec_get_response_count(CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS) - responses,
+             sunxi_hdmi_cec_get_dropped_count(CEC_MESSAGE_REPORT_POWER_STATUS) - dropped,
+             after.tx_frames - before.tx_frames);
+    report("polling_storm", elapsed, extra);
+}
+
+static int selected(const char *scenario, const char *name)
+{
+    return !scenario || !strcmp(scenario, name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int count = 10000;
+    int rate = 1000;
+    int bit_time_us = 0;
+    const char *scenario = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:b:as:l:")) != -1) {
+        switch (opt) {
+        case 'n': count = strtoul(optarg, NULL, 0); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'b': bit_time_us = atoi(optarg); break;
+        case 'a': setenv("HDMI_CEC_ASYNC_TX", "1", 1); break;
+        case 's': scenario = optarg; break;
+        case 'l': p99_limit_us = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n messages] [-r rate] [-b bit_time_us] [-a] [-s scenario] [-l p99_limit_us]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (count == 0 || rate <= 0) {
+        fprintf(stderr, "invalid count or rate\n");
+        return 2;
+    }
+
+    setenv("HDMI_CEC_TRANSPORT", "fake", 1);
+    if (!bit_time_us) {
+        // without bus timing there is no bus to be quiet on
+        setenv("HDMI_CEC_TX_SIGNAL_FREE_TIME", "0", 0);
+    }
+
+    hw_module_t *module = &HAL_MODULE_INFO_SYM;
+    hdmi_cec_device_t *dev = NULL;
+    int err = module->methods->open(module, HDMI_CEC_HARDWARE_INTERFACE, (hw_device_t **) &dev);
+    if (err != 0) {
+        ALOGE("Error opening hardware module: %d", err);
+        return 1;
+    }
+
+    sunxi_hdmi_cec_fake_set_bit_time(bit_time_us);
+    sunxi_hdmi_cec_fake_set_present(1 << TV);
+    sunxi_hdmi_cec_fake_set_tx_hook(tx_hook, NULL);
+
+    dev->clear_logical_address(dev);
+    dev->add_logical_address(dev, ME);
+    dev->set_option(dev, HDMI_OPTION_SYSTEM_CEC_CONTROL, 1);
+    dev->register_event_callback(dev, callback, dev);
+
+    if (selected(scenario, "rx_throughput")) {
+        bench_rx_throughput(count);
+    }
+    if (selected(scenario, "rx_latency")) {
+        bench_rx_latency(count < 2000 ? count : 2000, rate);
+    }
+    if (selected(scenario, "tx_directed")) {
+        bench_tx_latency(dev, count < 2000 ? count : 2000, "tx_directed", TV);
+    }
+    if (selected(scenario, "tx_broadcast")) {
+        bench_tx_latency(dev, count < 2000 ? count : 2000, "tx_broadcast", CEC_ADDR_BROADCAST);
+    }
+    if (selected(scenario, "polling_storm")) {
+        bench_polling_storm(count);
+    }
+
+    dev->common.close(&dev->common);
+    return failed;
+}
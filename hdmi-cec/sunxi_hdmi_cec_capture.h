@@ -0,0 +1,30 @@
+#ifndef __SUNXI_HDMI_CEC_CAPTURE_H__
+#define __SUNXI_HDMI_CEC_CAPTURE_H__
+
+#include <stdint.h>
+
+// Capture of every event read from the device, written by process_thread
+// to persist.cec.capture_file and played back by hdmi_cec.replay. A header
+// is followed by records until the end of the file. All fields are little
+// endian.
+
+#define CEC_CAPTURE_MAGIC 0x50434543 // "CECP"
+#define CEC_CAPTURE_VERSION 1
+
+typedef struct cec_capture_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+} cec_capture_header_t;
+
+typedef struct cec_capture_record {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC, when the device saw the event
+    uint16_t physical_address; // ours, 0xffff when unknown
+    uint16_t logical_address_mask; // ours, when the event arrived
+    uint8_t event_type; // MESSAGE_TYPE_*
+    uint8_t length;
+    uint8_t msg[17]; // header block first
+    uint8_t reserved;
+} cec_capture_record_t;
+
+#endif // __SUNXI_HDMI_CEC_CAPTURE_H__
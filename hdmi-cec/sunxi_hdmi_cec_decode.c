@@ -0,0 +1,172 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <string.h>
+#include "sunxi_hdmi_cec_decode.h"
+
+// Wide enough to decode a marginal bus, hdmi_cec.analyze checks the
+// tolerances. A '1' is low for 0.6ms, a '0' for 1.5ms and a start bit
+// for 3.7ms, the sample point is at 1.05ms.
+#define CEC_BIT_LOW_MIN_US 200
+#define CEC_BIT_SAMPLE_US 1050
+#define CEC_START_LOW_MIN_US 2500
+#define CEC_START_LOW_MAX_US 5000
+// longer than the high part of any bit
+#define CEC_FRAME_IDLE_US 4000
+
+void cec_decoder_init(cec_decoder_t *decoder, cec_frame_callback_t callback, void *arg) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->callback = callback;
+    decoder->arg = arg;
+    decoder->level = -1;
+}
+
+void cec_decoder_abort(cec_decoder_t *decoder, int flags) {
+    if (!decoder->in_frame) {
+        return;
+    }
+
+    decoder->frame.flags |= flags;
+    decoder->in_frame = 0;
+    if (decoder->callback) {
+        decoder->callback(&decoder->frame, decoder->arg);
+    }
+}
+
+void cec_decoder_lost(cec_decoder_t *decoder) {
+    cec_decoder_abort(decoder, CEC_FRAME_EDGES_LOST);
+    decoder->level = -1;
+}
+
+int cec_frame_bit(const cec_frame_t *frame, int index) {
+    int block = index / 10;
+    int position = index % 10;
+
+    if (position < 8) {
+        // data bits are shifted in, the last block may not be complete
+        int received = frame->bit_count - block * 10;
+        if (received > 8) {
+            received = 8;
+        }
+        return (frame->data[block] >> (received - 1 - position)) & 1;
+    } else if (position == 8) {
+        return (frame->eom >> block) & 1;
+    }
+    return (frame->ack >> block) & 1;
+}
+
+const char *cec_frame_error(int flags) {
+    if (flags & CEC_FRAME_EDGES_LOST) {
+        return "edges_lost";
+    } else if (flags & CEC_FRAME_BAD_BIT) {
+        return "bad_bit";
+    } else if (flags & CEC_FRAME_TOO_LONG) {
+        return "too_long";
+    } else if (flags & CEC_FRAME_TRUNCATED) {
+        return "truncated";
+    }
+    return NULL;
+}
+
+static void start_frame(cec_decoder_t *decoder, uint32_t low_us) {
+    cec_frame_t *frame = &decoder->frame;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->start_ns = frame->end_ns = decoder->fall_ns;
+    frame->start_bit.low_us = low_us;
+    decoder->in_frame = 1;
+}
+
+static void add_bit(cec_decoder_t *decoder, int value, uint32_t low_us) {
+    cec_frame_t *frame = &decoder->frame;
+    if (frame->bit_count >= CEC_FRAME_MAX_BITS) {
+        cec_decoder_abort(decoder, CEC_FRAME_TOO_LONG);
+        return;
+    }
+
+    frame->bits[frame->bit_count].low_us = low_us;
+    int block = frame->bit_count / 10;
+    int position = frame->bit_count % 10;
+    frame->bit_count++;
+
+    if (position < 8) {
+        frame->data[block] = (frame->data[block] << 1) | value;
+    } else if (position == 8) {
+        frame->eom |= value << block;
+    } else {
+        frame->ack |= value << block;
+        frame->length = block + 1;
+        if ((frame->eom >> block) & 1) {
+            cec_decoder_abort(decoder, 0);
+        }
+    }
+}
+
+void cec_decoder_edge(cec_decoder_t *decoder, int level, int64_t timestamp_ns) {
+    cec_frame_t *frame = &decoder->frame;
+    if (level == decoder->level) {
+        return;
+    }
+
+    if (!level) {
+        if (decoder->in_frame) {
+            uint32_t period_us = (timestamp_ns - decoder->fall_ns) / 1000;
+            if (timestamp_ns - decoder->rise_ns > CEC_FRAME_IDLE_US * 1000LL) {
+                cec_decoder_abort(decoder, CEC_FRAME_TRUNCATED);
+            } else if (frame->bit_count) {
+                frame->bits[frame->bit_count - 1].period_us = period_us;
+            } else {
+                frame->start_bit.period_us = period_us;
+            }
+        }
+        decoder->fall_ns = timestamp_ns;
+    } else if (decoder->level == 0) {
+        // a rising edge ends a low period we saw start
+        uint32_t low_us = (timestamp_ns - decoder->fall_ns) / 1000;
+        if (low_us >= CEC_START_LOW_MIN_US && low_us < CEC_START_LOW_MAX_US) {
+            cec_decoder_abort(decoder, CEC_FRAME_TRUNCATED);
+            start_frame(decoder, low_us);
+        } else if (!decoder->in_frame) {
+            // bits of a frame whose start we missed
+        } else if (low_us >= CEC_BIT_LOW_MIN_US && low_us < CEC_START_LOW_MIN_US) {
+            add_bit(decoder, low_us < CEC_BIT_SAMPLE_US, low_us);
+        } else {
+            cec_decoder_abort(decoder, CEC_FRAME_BAD_BIT);
+        }
+        decoder->rise_ns = timestamp_ns;
+    }
+
+    if (decoder->in_frame) {
+        frame->end_ns = timestamp_ns;
+    }
+    decoder->level = level;
+}
+
+void cec_decoder_idle(cec_decoder_t *decoder, int64_t now_ns) {
+    if (decoder->in_frame && decoder->level == 1 &&
+        now_ns - decoder->rise_ns > CEC_FRAME_IDLE_US * 1000LL) {
+        cec_decoder_abort(decoder, CEC_FRAME_TRUNCATED);
+    }
+}
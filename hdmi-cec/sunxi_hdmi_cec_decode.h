@@ -0,0 +1,65 @@
+#ifndef __SUNXI_HDMI_CEC_DECODE_H__
+#define __SUNXI_HDMI_CEC_DECODE_H__
+
+#include <stdint.h>
+
+// Rebuilds CEC frames from the edges of the line, shared by the line
+// dumper and the offline analyzer. Bits are told apart by how long the
+// line stays low, see CEC 1.4 section 5.2.2.
+
+#define CEC_FRAME_MAX_BLOCKS 16 // header block and up to 15 data blocks
+#define CEC_FRAME_MAX_BITS (CEC_FRAME_MAX_BLOCKS * 10)
+
+// why a frame ended without its EOM, a frame has at most one
+#define CEC_FRAME_TRUNCATED     (1 << 0) // the line went idle or a new start bit came
+#define CEC_FRAME_BAD_BIT       (1 << 1) // a low period no bit looks like
+#define CEC_FRAME_TOO_LONG      (1 << 2)
+#define CEC_FRAME_EDGES_LOST    (1 << 3) // the capture dropped edges
+
+typedef struct cec_bit_timing {
+    uint32_t low_us;
+    uint32_t period_us; // falling edge to falling edge, 0 for the last bit of a frame
+} cec_bit_timing_t;
+
+typedef struct cec_frame {
+    int64_t start_ns; // falling edge of the start bit
+    int64_t end_ns; // last edge of the frame
+    cec_bit_timing_t start_bit;
+    int flags;
+    int length; // complete blocks
+    uint8_t data[CEC_FRAME_MAX_BLOCKS]; // header block first
+    uint16_t eom; // bit per block
+    uint16_t ack; // ACK bit per block as seen on the line, 0 is an acknowledge for directed frames
+    int bit_count;
+    cec_bit_timing_t bits[CEC_FRAME_MAX_BITS];
+} cec_frame_t;
+
+typedef void (*cec_frame_callback_t)(const cec_frame_t *frame, void *arg);
+
+typedef struct cec_decoder {
+    cec_frame_callback_t callback;
+    void *arg;
+    int level; // -1 before the first edge
+    int64_t fall_ns;
+    int64_t rise_ns;
+    int in_frame;
+    cec_frame_t frame;
+} cec_decoder_t;
+
+void cec_decoder_init(cec_decoder_t *decoder, cec_frame_callback_t callback, void *arg);
+// level is 1 while the line is released, timestamps only need to be monotonic
+void cec_decoder_edge(cec_decoder_t *decoder, int level, int64_t timestamp_ns);
+// ends a frame whose line went idle before now
+void cec_decoder_idle(cec_decoder_t *decoder, int64_t now_ns);
+// ends the frame in progress, if any, with flags
+void cec_decoder_abort(cec_decoder_t *decoder, int flags);
+// edges went missing, ends the frame in progress and waits for the next falling edge
+void cec_decoder_lost(cec_decoder_t *decoder);
+
+// value of bit index of the frame, bits of a block are 8 data bits, EOM and ACK
+int cec_frame_bit(const cec_frame_t *frame, int index);
+
+// name of the error in frame flags, NULL for a complete frame
+const char *cec_frame_error(int flags);
+
+#endif // __SUNXI_HDMI_CEC_DECODE_H__
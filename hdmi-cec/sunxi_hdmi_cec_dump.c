@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
 #define LOG_TAG "test"
 
 #include <hardware/hdmi_cec.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <android/log.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -15,200 +23,954 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "log.h"
+#include "sunxi_hdmi_cec_decode.h"
+#include "sunxi_hdmi_cec_edges.h"
+#include "sunxi_hdmi_cec_opcodes.h"
 
 #define BASE_ADDRESS (unsigned long long)0xffffff8002600000
+#define PHYS_ADDRESS (unsigned long long)0x01ee0000 // the HDMI block BASE_ADDRESS maps
 #define CEC_PHY_ADDRESS 0x1003c
 
 #define DUMP_REG "/sys/devices/virtual/misc/sunxi-reg/rw/dump"
+#define MEM_DEVICE "/dev/mem"
+#define UIO_DEVICE "/dev/uio0"
+
+// Where the CEC PHY register is read from. mem and uio map the register
+// and read it with a volatile load, file does the same with a regular file
+// standing in for the register, sysfs asks the sunxi-reg debug driver for
+// every sample, which costs three syscalls and a sscanf.
+typedef struct reg_sampler reg_sampler_t;
+
+typedef struct reg_sampler_ops {
+  const char *name;
+  const char *default_path;
+  unsigned long long default_address; // physical, offset in the mapping or kernel virtual
+  int (*open)(reg_sampler_t *sampler, const char *path, unsigned long long address);
+  int (*read)(reg_sampler_t *sampler, unsigned int *value);
+  void (*close)(reg_sampler_t *sampler);
+} reg_sampler_ops_t;
+
+struct reg_sampler {
+  const reg_sampler_ops_t *ops;
+  int fd;
+  void *map;
+  size_t map_size;
+  volatile uint32_t *reg;
+};
+
+// Maps the page holding address, for /dev/mem and fake register files
+static int map_open(reg_sampler_t *sampler, const char *path, unsigned long long address) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  unsigned long long page = address & ~(unsigned long long) (page_size - 1);
+
+  sampler->fd = open(path, O_RDONLY | O_SYNC | O_CLOEXEC);
+  if(sampler->fd < 0) {
+    return -errno;
+  }
+
+  struct stat st;
+  if(fstat(sampler->fd, &st) == 0 && S_ISREG(st.st_mode) && (unsigned long long) st.st_size < address + 4) {
+    close(sampler->fd);
+    return -EINVAL;
+  }
+
+  sampler->map_size = page_size;
+  sampler->map = mmap(NULL, sampler->map_size, PROT_READ, MAP_SHARED, sampler->fd, page);
+  if(sampler->map == MAP_FAILED) {
+    int ret = -errno;
+    close(sampler->fd);
+    return ret;
+  }
+  sampler->reg = (volatile uint32_t *) ((char *) sampler->map + (address - page));
+  return 0;
+}
+
+// UIO maps are selected by the mmap offset, map 0 starts at 0, the
+// register is at address within it
+static int uio_open(reg_sampler_t *sampler, const char *path, unsigned long long address) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+
+  sampler->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(sampler->fd < 0) {
+    return -errno;
+  }
+
+  sampler->map_size = (address + 4 + page_size - 1) & ~(unsigned long long) (page_size - 1);
+  sampler->map = mmap(NULL, sampler->map_size, PROT_READ, MAP_SHARED, sampler->fd, 0);
+  if(sampler->map == MAP_FAILED) {
+    int ret = -errno;
+    close(sampler->fd);
+    return ret;
+  }
+  sampler->reg = (volatile uint32_t *) ((char *) sampler->map + address);
+  return 0;
+}
+
+static int map_read(reg_sampler_t *sampler, unsigned int *value) {
+  *value = *sampler->reg;
+  return 0;
+}
+
+static void map_close(reg_sampler_t *sampler) {
+  munmap(sampler->map, sampler->map_size);
+  close(sampler->fd);
+}
+
+static int sysfs_open(reg_sampler_t *sampler, const char *path, unsigned long long address) {
+  char buffer[64];
+
+  sampler->fd = open(path, O_RDWR | O_CLOEXEC);
+  if(sampler->fd < 0) {
+    return -errno;
+  }
+
+  sprintf(buffer, "0x%016llx,0x%016llx", address, address);
+  printf("Requesting: %s\n", buffer);
+
+  if(write(sampler->fd, buffer, strlen(buffer)) < 0) {
+    int ret = -errno;
+    close(sampler->fd);
+    return ret;
+  }
+  return 0;
+}
+
+static int sysfs_read(reg_sampler_t *sampler, unsigned int *value) {
+  char buffer[64];
+
+  lseek(sampler->fd, 0, SEEK_SET);
+
+  int ret = read(sampler->fd, buffer, sizeof(buffer)-1);
+  if(ret < 0) {
+    return -errno;
+  }
+
+  buffer[ret] = 0;
+
+  if(sscanf(buffer, "0x%08x", value) != 1) {
+    fprintf(stderr, "Failed to parse: %s", buffer);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static void sysfs_close(reg_sampler_t *sampler) {
+  close(sampler->fd);
+}
+
+static const reg_sampler_ops_t samplers[] = {
+  {"mem", MEM_DEVICE, PHYS_ADDRESS + CEC_PHY_ADDRESS, map_open, map_read, map_close},
+  {"uio", UIO_DEVICE, CEC_PHY_ADDRESS, uio_open, map_read, map_close},
+  {"file", NULL, 0, map_open, map_read, map_close},
+  {"sysfs", DUMP_REG, BASE_ADDRESS + CEC_PHY_ADDRESS, sysfs_open, sysfs_read, sysfs_close},
+};
+
+static const reg_sampler_ops_t *find_sampler(const char *name) {
+  for(size_t i = 0; i < sizeof(samplers) / sizeof(samplers[0]); i++) {
+    if(!strcmp(samplers[i].name, name)) {
+      return &samplers[i];
+    }
+  }
+  return NULL;
+}
+
+static int open_sampler(reg_sampler_t *sampler, const reg_sampler_ops_t *ops,
+                        const char *path, unsigned long long address, int has_address) {
+  if(!path) {
+    path = ops->default_path;
+  }
+  if(!path) {
+    fprintf(stderr, "%s: needs -d path\n", ops->name);
+    return -EINVAL;
+  }
+
+  memset(sampler, 0, sizeof(*sampler));
+  sampler->ops = ops;
+  int ret = ops->open(sampler, path, has_address ? address : ops->default_address);
+  if(ret < 0) {
+    fprintf(stderr, "%s: failed to open %s: %s\n", ops->name, path, strerror(-ret));
+  }
+  return ret;
+}
 
-static int fd;
+// back to back reads, what the backend costs without the sampling period
+static void measure_rate(reg_sampler_t *sampler, long samples) {
+  struct timespec start, end;
+  unsigned int value;
 
-struct timespec current_time()
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(long i = 0; i < samples; i++) {
+    if(sampler->ops->read(sampler, &value) < 0) {
+      perror("Failed to read CEC_PHY");
+      return;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%s: %ld samples in %.6fs, %.0f samples/s, %.1fns/sample, last=0x%08x\n",
+         sampler->ops->name, samples, seconds, samples / seconds, seconds * 1e9 / samples, value);
+}
+
+static struct timespec current_time(void)
 {
     struct timespec start_time;
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_time);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     return start_time;
 }
 
-long long timer_diff(struct timespec start_time, struct timespec end_time)
+static long long monotonic_ns(void)
 {
-    long long diff = end_time.tv_nsec - start_time.tv_nsec;
-    if (end_time.tv_sec > start_time.tv_sec) {
-      diff += (end_time.tv_sec - start_time.tv_sec) * 1000LL * 1000LL * 1000LL;
-    }
-    return diff;
+    struct timespec ts = current_time();
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 // #define PRINT_STREAM
 #define WAIT_TIME 80
 #define IN_LINE 80
-#define START_BIT 10
-#define BIT_1_HI 4
-#define BIT_1_LO 2
-#define BIT_0_HI 2
-#define BIT_0_LO 4
+#define EDGE_RING_SIZE 4096 // power of two, about 300ms of the busiest bus at 80us
+#define DECODE_POLL_US 1000
+#define DECODE_IDLE_POLL_US 10000 // triggered captures, the ring holds seconds of a busy bus
+#define EDGE_FILE_BUFFER (64 * 1024)
+#define PRETRIGGER_SAMPLES 32 // at the idle period, what led up to a trigger
+// a triggering start bit is only known to an idle period, its 3.5ms to 3.9ms
+// off by that much must stay within the 2.5ms to 5ms the decoder takes
+#define TRIGGER_PERIOD_MAX_US 1000
+#define IDLE_TIMEOUT_MS 100
+
+#define LATE_BUCKETS 16 // log2 microseconds
+
+// Samples are taken at absolute deadlines on CLOCK_MONOTONIC, so the time
+// spent reading and decoding never adds up. A wakeup later than a whole
+// period skips the deadlines it missed instead of sampling in a burst.
+typedef struct sample_clock {
+  long long period_ns;
+  long long deadline_ns;
+  int spin;
+  unsigned long long samples;
+  unsigned long long missed;
+  long long max_late_ns;
+  long long total_late_ns;
+  unsigned int late_buckets[LATE_BUCKETS];
+} sample_clock_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static void start_clock(sample_clock_t *clock, long period_us, int spin) {
+  memset(clock, 0, sizeof(*clock));
+  clock->period_ns = period_us * 1000LL;
+  clock->spin = spin;
+  clock->deadline_ns = monotonic_ns();
+}
 
-void sleep_us(struct timespec start_time, long long how_long)
-{
-  for(;;) {
-    if(timer_diff(start_time, current_time()) > how_long * 1000LL)
-      break;
-    usleep(1);
+// the next deadline is one new period after the current one
+static void set_clock_period(sample_clock_t *clock, long period_us, int spin) {
+  clock->period_ns = period_us * 1000LL;
+  clock->spin = spin;
+}
+
+static void wait_clock(sample_clock_t *clock) {
+  clock->deadline_ns += clock->period_ns;
+
+  if(clock->spin) {
+    while(monotonic_ns() < clock->deadline_ns);
+  } else {
+    struct timespec ts = {clock->deadline_ns / 1000000000LL, clock->deadline_ns % 1000000000LL};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop_requested);
+  }
+
+  long long late = monotonic_ns() - clock->deadline_ns;
+  if(late < 0) {
+    late = 0;
+  }
+  if(clock->period_ns > 0 && late >= clock->period_ns) {
+    long long missed = late / clock->period_ns;
+    clock->missed += missed;
+    clock->deadline_ns += missed * clock->period_ns;
+  }
+
+  int bucket = 0;
+  for(long long us = late / 1000; us && bucket < LATE_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  clock->late_buckets[bucket]++;
+  clock->samples++;
+  clock->total_late_ns += late;
+  if(late > clock->max_late_ns) {
+    clock->max_late_ns = late;
+  }
+}
+
+static void print_clock_stats(FILE *out, const sample_clock_t *clock) {
+  fprintf(out, "# samples=%llu period_us=%lld missed=%llu late_avg_us=%.1f late_max_us=%.1f\n",
+          clock->samples, clock->period_ns / 1000, clock->missed,
+          clock->samples ? clock->total_late_ns / 1000.0 / clock->samples : 0.0,
+          clock->max_late_ns / 1000.0);
+  for(int bucket = 0; bucket < LATE_BUCKETS; bucket++) {
+    if(clock->late_buckets[bucket]) {
+      fprintf(out, "# late_le_us=%u count=%u\n", bucket ? (1u << bucket) - 1 : 0, clock->late_buckets[bucket]);
+    }
+  }
+  fflush(out);
+}
+
+static void handle_signal(int signal) {
+  if(signal == SIGUSR1) {
+    stats_requested = 1;
+  } else {
+    stop_requested = 1;
+  }
+}
+
+// Pins the calling thread and makes it SCHED_FIFO. The default 50us timer
+// slack alone is most of a sampling period, it goes down to 1ns.
+static void setup_realtime(int priority, int cpu) {
+  prctl(PR_SET_TIMERSLACK, 1);
+
+  if(cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+      perror("Failed to pin to the cpu");
+    }
+  }
+
+  if(priority > 0) {
+    struct sched_param param = {.sched_priority = priority};
+    if(sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+      perror("Failed to set SCHED_FIFO");
+    }
+    // a page fault in the loop is a missed deadline
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      perror("Failed to lock memory");
+    }
+  }
+}
+
+// The sampler thread only pushes the samples where the register changed,
+// the decoder thread times the bits from them and does all the printing,
+// so a stalled stdout never moves a sample. Single producer and single
+// consumer, head and tail only ever grow.
+typedef struct edge {
+  long long timestamp_ns;
+  unsigned int value;
+  unsigned int lost; // edges dropped right before this one
+} edge_t;
+
+typedef struct edge_ring {
+  edge_t edges[EDGE_RING_SIZE];
+  unsigned int head;
+  unsigned int tail;
+  unsigned int lost;
+  unsigned long long overflows;
+} edge_ring_t;
+
+static int push_edge(edge_ring_t *ring, long long timestamp_ns, unsigned int value) {
+  unsigned int tail = ring->tail;
+
+  if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= EDGE_RING_SIZE) {
+    ring->lost++;
+    ring->overflows++;
+    return -ENOSPC;
   }
+
+  edge_t *edge = &ring->edges[tail & (EDGE_RING_SIZE - 1)];
+  edge->timestamp_ns = timestamp_ns;
+  edge->value = value;
+  edge->lost = ring->lost;
+  ring->lost = 0;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
 }
 
-int bit_count = -1;
-int bit_value = 0;
-int bit_index = 0;
+static int pop_edge(edge_ring_t *ring, edge_t *edge) {
+  unsigned int head = ring->head;
+
+  if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
 
-void start_bit() {
-  bit_count = 0;
-  bit_value = 0;
-  bit_index = 0;
+  *edge = ring->edges[head & (EDGE_RING_SIZE - 1)];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
 }
 
-void add_bit(int bit) {
-  if(bit_count < 0) {
+// Streams the level changes in the sunxi_hdmi_cec_edges.h format for
+// hdmi_cec.analyze, written from the decoder thread.
+typedef struct edge_writer {
+  FILE *file;
+  long long start_ns;
+  long long last_us;
+  int level;
+} edge_writer_t;
+
+static int open_edge_writer(edge_writer_t *writer, const char *path, long period_us, long idle_period_us) {
+  writer->file = fopen(path, "wb");
+  if(!writer->file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  setvbuf(writer->file, NULL, _IOFBF, EDGE_FILE_BUFFER);
+
+  writer->start_ns = monotonic_ns();
+  writer->last_us = 0;
+  writer->level = -1;
+
+  cec_edges_header_t header = {
+    .magic = CEC_EDGES_MAGIC,
+    .version = CEC_EDGES_VERSION,
+    .record_size = sizeof(uint16_t),
+    .period_us = period_us,
+    .idle_period_us = idle_period_us,
+    .start_ns = writer->start_ns,
+  };
+  fwrite(&header, sizeof(header), 1, writer->file);
+  return 0;
+}
+
+static void write_escape(edge_writer_t *writer, int level, uint32_t delta_us) {
+  uint16_t records[3] = {
+    cec_edge_record(level, CEC_EDGE_ESCAPE),
+    delta_us & 0xffff,
+    delta_us >> 16,
+  };
+  fwrite(records, sizeof(records), 1, writer->file);
+}
+
+static void write_edge(edge_writer_t *writer, int level, long long timestamp_ns) {
+  if(!writer->file || level == writer->level) {
     return;
   }
 
-  bit_count++;
-  bit_value <<= 1;
-  bit_value |= bit ? 1 : 0;
+  // deltas come from absolute times so rounding never accumulates
+  long long now_us = (timestamp_ns - writer->start_ns) / 1000;
+  long long delta_us = now_us - writer->last_us;
+  while(delta_us > CEC_EDGE_LONG_DELTA_MAX) {
+    write_escape(writer, writer->level > 0, CEC_EDGE_LONG_DELTA_MAX);
+    delta_us -= CEC_EDGE_LONG_DELTA_MAX;
+  }
+  if(delta_us > CEC_EDGE_DELTA_MAX) {
+    write_escape(writer, level, delta_us);
+  } else {
+    uint16_t record = cec_edge_record(level, delta_us < 0 ? 0 : delta_us);
+    fwrite(&record, sizeof(record), 1, writer->file);
+  }
 
-  if(bit_count == 10) {
-    fprintf(stdout, "%d %02x EOM:%d ACK:%d\n", bit_index, bit_value >> 2, (bit_value & 2) ? 1 : 0, ~bit_value & 1);
-    fflush(stdout);
-    if(bit_value & 2) {
-      bit_count = -1;
-    } else {
-      bit_count = 0;
-      bit_value = 0;
-      bit_index++;
-    }
+  writer->last_us = now_us;
+  writer->level = level;
+}
+
+static void write_lost(edge_writer_t *writer) {
+  if(!writer->file) {
+    return;
   }
+
+  write_escape(writer, 0, CEC_EDGE_LOST);
+  writer->level = -1;
 }
 
-int main(int argc, char *argv[])
-{
-  char line[IN_LINE+1] = {0};
-  char buffer[64];
-  char decoded[64];
-  int ret;
-  struct timespec last, current;
+static int close_edge_writer(edge_writer_t *writer) {
+  if(!writer->file) {
+    return 0;
+  }
 
-  int hi = 0, lo = 0, last_hi = 0, last_lo = 0, hilo = -1;
+  int ret = ferror(writer->file);
+  if(fclose(writer->file) != 0 || ret) {
+    perror("Failed to write the edges");
+    return -1;
+  }
+  return 0;
+}
 
-  fd = open(DUMP_REG, O_RDWR);
-  if(fd < 0) {
-    perror("Failed to open sunxi-reg/dump");
-    return 1;
+// Streams the capture as a VCD with a 1us timescale: the line level, the
+// raw register and the frames the decoder found, written as they end.
+// PulseView opens it and its CEC decoder runs on the cec wire.
+typedef struct vcd_writer {
+  FILE *file;
+  long long start_ns;
+  long long last_us;
+  int level;
+  unsigned int value;
+} vcd_writer_t;
+
+#define VCD_LEVEL "!"
+#define VCD_REGISTER "\""
+#define VCD_FRAME "#"
+
+static int open_vcd_writer(vcd_writer_t *writer, const char *path) {
+  writer->file = fopen(path, "w");
+  if(!writer->file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
   }
+  setvbuf(writer->file, NULL, _IOFBF, EDGE_FILE_BUFFER);
+
+  writer->start_ns = monotonic_ns();
+  writer->last_us = 0;
+  writer->level = -1;
+  writer->value = ~0u;
+
+  time_t now = time(NULL);
+  char date[64];
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  fprintf(writer->file,
+          "$date %s $end\n"
+          "$version hdmi_cec.dump $end\n"
+          "$timescale 1us $end\n"
+          "$scope module hdmi $end\n"
+          "$var wire 1 " VCD_LEVEL " cec $end\n"
+          "$var wire 32 " VCD_REGISTER " cec_phy $end\n"
+          "$var string 1 " VCD_FRAME " frame $end\n"
+          "$upscope $end\n"
+          "$enddefinitions $end\n"
+          "#0\n"
+          "$dumpvars\n"
+          "x" VCD_LEVEL "\n"
+          "bx " VCD_REGISTER "\n"
+          "s- " VCD_FRAME "\n"
+          "$end\n", date);
+  return 0;
+}
 
-  sprintf(buffer, "0x%016llx,0x%016llx", BASE_ADDRESS + CEC_PHY_ADDRESS, BASE_ADDRESS + CEC_PHY_ADDRESS);
-  printf("Requesting: %s\n", buffer);
+// VCD times only go forward, a frame ended by the idle timeout is stamped
+// when it is written
+static void vcd_time(vcd_writer_t *writer, long long timestamp_ns) {
+  long long now_us = (timestamp_ns - writer->start_ns) / 1000;
 
-  ret = write(fd, buffer, strlen(buffer));
-  if(ret < 0) {
-    perror("Failed to request CEC_PHY");
-    return 1;
+  if(now_us > writer->last_us) {
+    fprintf(writer->file, "#%lld\n", now_us);
+    writer->last_us = now_us;
+  }
+}
+
+static void write_vcd_value(vcd_writer_t *writer, unsigned int value, long long timestamp_ns) {
+  if(!writer->file || value == writer->value) {
+    return;
+  }
+
+  vcd_time(writer, timestamp_ns);
+
+  int level = (value & 0x2) ? 1 : 0;
+  if(level != writer->level) {
+    fprintf(writer->file, "%d" VCD_LEVEL "\n", level);
+    writer->level = level;
   }
 
+  char bits[33];
   int count = 0;
+  for(int bit = 31; bit >= 0; bit--) {
+    if(count || (value >> bit) & 1 || !bit) {
+      bits[count++] = '0' + ((value >> bit) & 1);
+    }
+  }
+  bits[count] = 0;
+  fprintf(writer->file, "b%s " VCD_REGISTER "\n", bits);
+  writer->value = value;
+}
 
-  last = current_time();
+static void write_vcd_lost(vcd_writer_t *writer, long long timestamp_ns) {
+  if(!writer->file) {
+    return;
+  }
 
-  for(;;) {
-    unsigned int value;
+  vcd_time(writer, timestamp_ns);
+  fprintf(writer->file, "x" VCD_LEVEL "\nbx " VCD_REGISTER "\n");
+  writer->level = -1;
+  writer->value = ~0u;
+}
+
+// VCD strings end at whitespace, the fields are joined with _
+static void write_vcd_frame(vcd_writer_t *writer, const cec_frame_t *frame) {
+  if(!writer->file) {
+    return;
+  }
+
+  vcd_time(writer, frame->end_ns);
+  if(frame->length >= 1) {
+    fprintf(writer->file, "s%x->%x_%s", frame->data[0] >> 4, frame->data[0] & 0x0f,
+            frame->length >= 2 ? cec_opcode_name(frame->data[1]) : "POLL");
+  } else {
+    fprintf(writer->file, "s?->?");
+  }
+  for(int i = 0; i < frame->length; i++) {
+    fprintf(writer->file, "_%02x", frame->data[i]);
+  }
+  if(frame->length) {
+    // an ACK bit pulled low acknowledges a directed frame and rejects a broadcast
+    int broadcast = (frame->data[0] & 0x0f) == 0x0f;
+    fputs("_ack=", writer->file);
+    for(int i = 0; i < frame->length; i++) {
+      fputc(((frame->ack >> i) & 1) == broadcast ? 'A' : 'N', writer->file);
+    }
+  }
+  if(frame->flags) {
+    fprintf(writer->file, "_error=%s", cec_frame_error(frame->flags));
+  }
+  fprintf(writer->file, " " VCD_FRAME "\n");
+}
+
+static int close_vcd_writer(vcd_writer_t *writer) {
+  if(!writer->file) {
+    return 0;
+  }
+
+  int ret = ferror(writer->file);
+  if(fclose(writer->file) != 0 || ret) {
+    perror("Failed to write the VCD");
+    return -1;
+  }
+  return 0;
+}
 
-    struct timespec start = current_time();
+typedef struct dumper {
+  reg_sampler_t sampler;
+  sample_clock_t clock;
+  long period_us;
+  int fifo_priority;
+  int cpu;
+  int spin;
+  int error;
+  // triggered capture, sample every trigger_period_us until the line goes
+  // low, at period_us until it has been idle for idle_timeout_ms
+  long trigger_period_us;
+  long idle_timeout_ms;
+  int one_shot;
+  unsigned int max_frames;
+  unsigned int frames;
+  unsigned int triggers;
+  volatile int sampling;
+  edge_writer_t writer;
+  vcd_writer_t vcd;
+  edge_ring_t ring;
+} dumper_t;
+
+static void *sampler_thread(void *arg) {
+  dumper_t *dumper = arg;
+  unsigned int last_value = ~0u;
+  edge_t pretrigger[PRETRIGGER_SAMPLES];
+  unsigned int pretrigger_count = 0;
+  int triggered = !dumper->trigger_period_us;
+  long long last_edge_ns = 0;
+
+  setup_realtime(dumper->fifo_priority, dumper->cpu);
+  if(triggered) {
+    start_clock(&dumper->clock, dumper->period_us, dumper->spin);
+  } else {
+    // spinning for a whole idle period would keep the core busy
+    start_clock(&dumper->clock, dumper->trigger_period_us, 0);
+  }
 
-    lseek(fd, 0, SEEK_SET);
+  while(!stop_requested) {
+    unsigned int value;
+    long long now = monotonic_ns();
 
-    ret = read(fd, buffer, sizeof(buffer)-1);
+    int ret = dumper->sampler.ops->read(&dumper->sampler, &value);
     if(ret < 0) {
-      perror("Failed to read CEC_PHY");
-      return 1;
+      fprintf(stderr, "Failed to read CEC_PHY: %s\n", strerror(-ret));
+      dumper->error = 1;
+      break;
     }
 
-    buffer[ret] = 0;
+    if(!triggered) {
+      edge_t *sample = &pretrigger[pretrigger_count++ % PRETRIGGER_SAMPLES];
+      sample->timestamp_ns = now;
+      sample->value = value;
+
+      if(!(value & 0x2)) {
+        // a start bit is low for 3.7ms, it cannot hide between idle samples;
+        // it fell after the last high one, stamp it there rather than cut
+        // up to an idle period off its length
+        if(pretrigger_count > 1) {
+          sample->timestamp_ns = pretrigger[(pretrigger_count - 2) % PRETRIGGER_SAMPLES].timestamp_ns;
+        }
+        unsigned int first = pretrigger_count > PRETRIGGER_SAMPLES ? pretrigger_count - PRETRIGGER_SAMPLES : 0;
+        for(unsigned int i = first; i < pretrigger_count; i++) {
+          sample = &pretrigger[i % PRETRIGGER_SAMPLES];
+          if(sample->value != last_value && push_edge(&dumper->ring, sample->timestamp_ns, sample->value) == 0) {
+            last_value = sample->value;
+          }
+        }
+        pretrigger_count = 0;
+        triggered = 1;
+        dumper->triggers++;
+        last_edge_ns = now;
+        set_clock_period(&dumper->clock, dumper->period_us, dumper->spin);
+      }
+    } else if(value != last_value && push_edge(&dumper->ring, now, value) == 0) {
+      last_value = value;
+      last_edge_ns = now;
+    } else if(dumper->trigger_period_us && (value & 0x2) &&
+              now - last_edge_ns > dumper->idle_timeout_ms * 1000000LL) {
+      if(dumper->one_shot) {
+        break;
+      }
+      triggered = 0;
+      set_clock_period(&dumper->clock, dumper->trigger_period_us, 0);
+    }
 
-    ret = sscanf(buffer, "0x%08x", &value);
-    if(ret != 1) {
-      fprintf(stderr, "Failed to parse: %s", buffer);
-      return 1;
+    wait_clock(&dumper->clock);
+    if(stats_requested) {
+      stats_requested = 0;
+      print_clock_stats(stderr, &dumper->clock);
+    }
+  }
+
+  __atomic_store_n(&dumper->sampling, 0, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void print_frame(const cec_frame_t *frame, void *arg) {
+  dumper_t *dumper = arg;
+
+  if(dumper->max_frames && ++dumper->frames >= dumper->max_frames) {
+    stop_requested = 1;
+  }
+
+  write_vcd_frame(&dumper->vcd, frame);
+
+  for(int i = 0; i < frame->length; i++) {
+    fprintf(stdout, "%d %02x EOM:%d ACK:%d\n", i, frame->data[i], (frame->eom >> i) & 1, ~(frame->ack >> i) & 1);
+  }
+  if(frame->flags) {
+    fprintf(stdout, "# frame error=%s bits=%d\n", cec_frame_error(frame->flags), frame->bit_count);
+  }
+  fflush(stdout);
+}
+
+#ifdef PRINT_STREAM
+// The samples as line art, rebuilt from the edges, with the bits the
+// decoder found in each line.
+typedef struct stream_printer {
+  char line[IN_LINE+1];
+  char decoded[IN_LINE+1];
+  int count;
+  int decoded_count;
+  long long line_start_ns;
+  long long period_ns;
+} stream_printer_t;
+
+static char sample_char(unsigned int value) {
+  switch(value) {
+  case 0x2: return 'X'; // LINE ON
+  case 0x4: return 'Y';
+  case 0x0: return '.'; // LINE OFF
+  case 0x84: return ':';
+  case 0x86: return ';';
+  default: return '+';
+  }
+}
+
+static void stream_samples(stream_printer_t *printer, unsigned int value, long long from_ns, long long to_ns) {
+  long long samples = (to_ns - from_ns + printer->period_ns / 2) / printer->period_ns;
+
+  for(long long i = 0; i < samples; i++) {
+    printer->line[printer->count++] = sample_char(value);
+    if(printer->count >= IN_LINE) {
+      long long now = from_ns + (i + 1) * printer->period_ns;
+      printer->line[printer->count] = 0;
+      printer->decoded[printer->decoded_count] = 0;
+      fprintf(stdout, "%s: took %lldus: %s\n", printer->line, (now - printer->line_start_ns) / 1000 / printer->count, printer->decoded);
+      fflush(stdout);
+      printer->line_start_ns = now;
+      printer->count = 0;
+      printer->decoded_count = 0;
     }
+  }
+}
+
+static void stream_bit(stream_printer_t *printer, char bit) {
+  if(printer->decoded_count < IN_LINE) {
+    printer->decoded[printer->decoded_count++] = bit;
+  }
+}
+
+// what the last edge added to the frame, S for a start bit
+static char last_bit(const cec_frame_t *frame) {
+  if(!frame->bit_count) {
+    return 'S';
+  }
+  return cec_frame_bit(frame, frame->bit_count - 1) ? '1' : '0';
+}
+#endif
+
+static void decode_edges(dumper_t *dumper) {
+  cec_decoder_t decoder;
+  edge_t edge;
+#ifdef PRINT_STREAM
+  stream_printer_t printer = {.period_ns = dumper->period_us * 1000LL};
+  edge_t previous = {0};
+  int has_previous = 0;
+#endif
+
+  cec_decoder_init(&decoder, print_frame, dumper);
+
+  for(;;) {
+    int sampling = __atomic_load_n(&dumper->sampling, __ATOMIC_ACQUIRE);
 
-    switch(value) {
-    case 0x2: // LINE ON
-      line[count] = 'X';
-      if(hi == 0) {
-        last_hi = hi;
-        last_lo = lo;
-        lo = 0;
+    while(pop_edge(&dumper->ring, &edge)) {
+      if(edge.lost) {
+        cec_decoder_lost(&decoder);
+        write_lost(&dumper->writer);
+        write_vcd_lost(&dumper->vcd, edge.timestamp_ns);
       }
-      hi++;
-      break;
 
-    case 0x4:
-      line[count] = 'Y';
-      break;
+#ifdef PRINT_STREAM
+      int bit_count = decoder.frame.bit_count;
+      long long start_ns = decoder.frame.start_ns;
+      if(has_previous) {
+        stream_samples(&printer, previous.value, previous.timestamp_ns, edge.timestamp_ns);
+      } else {
+        printer.line_start_ns = edge.timestamp_ns;
+      }
+      previous = edge;
+      has_previous = 1;
+#endif
+
+      int level = (edge.value & 0x2) ? 1 : 0;
+      write_edge(&dumper->writer, level, edge.timestamp_ns);
+      write_vcd_value(&dumper->vcd, edge.value, edge.timestamp_ns);
+      cec_decoder_edge(&decoder, level, edge.timestamp_ns);
 
-    case 0x0: // LINE OFF
-      line[count] = '.';
-      if(lo == 0) {
-        last_hi = hi;
-        last_lo = lo;
-        hi = 0;
+#ifdef PRINT_STREAM
+      if(decoder.frame.bit_count != bit_count || decoder.frame.start_ns != start_ns) {
+        stream_bit(&printer, last_bit(&decoder.frame));
       }
-      lo++;
-      break;
+#endif
+    }
 
-    case 0x84:
-      line[count] = ':';
+    if(!sampling) {
       break;
+    }
+    cec_decoder_idle(&decoder, monotonic_ns());
+    usleep(dumper->trigger_period_us ? DECODE_IDLE_POLL_US : DECODE_POLL_US);
+  }
 
-    case 0x86:
-      line[count] = ';';
-      break;
+  cec_decoder_abort(&decoder, CEC_FRAME_TRUNCATED);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-b mem|uio|file|sysfs] [-d path] [-a address] [-t period_us] [-r samples]\n"
+                  "       [-f fifo_priority] [-c cpu] [-s] [-o edges-file] [-v vcd-file]\n"
+                  "       [-T idle_period_us] [-w idle_timeout_ms] [-1] [-n frames]\n", name);
+  fprintf(stderr, "  without -b the register is mapped from " MEM_DEVICE ", falling back to sysfs\n");
+  fprintf(stderr, "  -a is the physical address for mem, the offset in the mapping for uio and file\n");
+  fprintf(stderr, "  -r measures the read rate of the backend and exits\n");
+  fprintf(stderr, "  -s spins to the deadline instead of sleeping, best with -f and -c\n");
+  fprintf(stderr, "  -o also streams the edges to a file for hdmi_cec.analyze\n");
+  fprintf(stderr, "  -v also streams the capture and the decoded frames as VCD, for PulseView\n");
+  fprintf(stderr, "  -T samples every idle_period_us, at most %dus, until the line goes low, then at\n"
+                  "     the full rate until it has been idle for -w, %dms by default, -1 stops there\n"
+                  "     instead\n", TRIGGER_PERIOD_MAX_US, IDLE_TIMEOUT_MS);
+  fprintf(stderr, "  -n stops after that many frames\n");
+  fprintf(stderr, "  timing statistics go to stderr on exit and on SIGUSR1\n");
+}
 
+int main(int argc, char *argv[])
+{
+  const char *backend = NULL, *path = NULL, *edges_path = NULL, *vcd_path = NULL;
+  unsigned long long address = 0;
+  int has_address = 0;
+  long rate_samples = 0;
+  dumper_t *dumper;
+  pthread_t thread;
+  int opt;
+
+  // the ring is too big for the stack
+  dumper = calloc(1, sizeof(*dumper));
+  if(!dumper) {
+    return 1;
+  }
+  dumper->period_us = WAIT_TIME;
+  dumper->cpu = -1;
+  dumper->idle_timeout_ms = IDLE_TIMEOUT_MS;
+
+  while((opt = getopt(argc, argv, "b:d:a:t:r:f:c:so:v:T:w:1n:")) != -1) {
+    switch(opt) {
+    case 'b': backend = optarg; break;
+    case 'd': path = optarg; break;
+    case 'a': address = strtoull(optarg, NULL, 0); has_address = 1; break;
+    case 't': dumper->period_us = strtol(optarg, NULL, 0); break;
+    case 'r': rate_samples = strtol(optarg, NULL, 0); break;
+    case 'f': dumper->fifo_priority = atoi(optarg); break;
+    case 'c': dumper->cpu = atoi(optarg); break;
+    case 's': dumper->spin = 1; break;
+    case 'o': edges_path = optarg; break;
+    case 'v': vcd_path = optarg; break;
+    case 'T': dumper->trigger_period_us = strtol(optarg, NULL, 0); break;
+    case 'w': dumper->idle_timeout_ms = strtol(optarg, NULL, 0); break;
+    case '1': dumper->one_shot = 1; break;
+    case 'n': dumper->max_frames = strtoul(optarg, NULL, 0); break;
     default:
-      line[count] = '+';
-      break;
+      usage(argv[0]);
+      return 2;
     }
+  }
 
-    if(lo > START_BIT) {
-      last_hi = last_lo = lo = hi = 0;
-      strcat(decoded, "S");
-      start_bit();
-    } else if(last_lo >= BIT_1_LO && hi >= BIT_1_HI) {
-      last_hi = last_lo = lo = hi = 0;
-      strcat(decoded, "1");
-      add_bit(1);
-    } else if(last_lo >= BIT_0_LO && hi >= BIT_0_HI) {
-      last_hi = last_lo = lo = hi = 0;
-      strcat(decoded, "0");
-      add_bit(0);
+  if(dumper->trigger_period_us < 0 || dumper->trigger_period_us > TRIGGER_PERIOD_MAX_US) {
+    fprintf(stderr, "The idle period must be at most %dus\n", TRIGGER_PERIOD_MAX_US);
+    usage(argv[0]);
+    return 2;
+  }
+
+  if(backend) {
+    const reg_sampler_ops_t *ops = find_sampler(backend);
+    if(!ops) {
+      usage(argv[0]);
+      return 2;
+    }
+    if(open_sampler(&dumper->sampler, ops, path, address, has_address) < 0) {
+      return 1;
     }
+  } else if(open_sampler(&dumper->sampler, find_sampler("mem"), NULL, address, has_address) < 0) {
+    fprintf(stderr, "Falling back to sysfs\n");
+    if(open_sampler(&dumper->sampler, find_sampler("sysfs"), NULL, 0, 0) < 0) {
+      return 1;
+    }
+  }
 
-    sleep_us(start, WAIT_TIME);
+  if(rate_samples > 0) {
+    measure_rate(&dumper->sampler, rate_samples);
+    dumper->sampler.ops->close(&dumper->sampler);
+    return 0;
+  }
 
-    if(++count >= IN_LINE) {
-      last = current;
-      current = current_time();
+  if(edges_path && open_edge_writer(&dumper->writer, edges_path, dumper->period_us, dumper->trigger_period_us) < 0) {
+    return 1;
+  }
+  if(vcd_path && open_vcd_writer(&dumper->vcd, vcd_path) < 0) {
+    return 1;
+  }
 
-#ifdef PRINT_STREAM
-      long long diff = timer_diff(last, current);
-      fprintf(stdout, "%s: took %lldus: %s", line, diff / 1000 / count, decoded);
-      fputc('\n', stdout);
-      fflush(stdout);
-#endif
-      decoded[0] = 0;
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGUSR1, handle_signal);
 
-      count = 0;
-    }
+  dumper->sampling = 1;
+  if(pthread_create(&thread, NULL, sampler_thread, dumper) != 0) {
+    perror("Failed to start the sampler");
+    return 1;
   }
 
-  close(fd);
-  return 0;
+  decode_edges(dumper);
+  pthread_join(thread, NULL);
+
+  print_clock_stats(stderr, &dumper->clock);
+  if(dumper->trigger_period_us) {
+    fprintf(stderr, "# triggers=%u\n", dumper->triggers);
+  }
+  if(dumper->ring.overflows) {
+    fprintf(stderr, "# edge_ring_overflows=%llu\n", dumper->ring.overflows);
+  }
+  dumper->sampler.ops->close(&dumper->sampler);
+  int ret = dumper->error;
+  if(close_edge_writer(&dumper->writer) < 0) {
+    ret = 1;
+  }
+  if(close_vcd_writer(&dumper->vcd) < 0) {
+    ret = 1;
+  }
+  free(dumper);
+  return ret;
 }
@@ -0,0 +1,69 @@
+#ifndef __SUNXI_HDMI_CEC_EDGES_H__
+#define __SUNXI_HDMI_CEC_EDGES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Edges of the CEC line, streamed by hdmi_cec.dump -o and decoded by
+// hdmi_cec.analyze. A header is followed by one 16 bit record per level
+// change until the end of the file, about 4 bytes per CEC bit on a busy
+// bus. All fields are little endian.
+//
+// A record holds the level the line changed to and the microseconds since
+// the previous record. A delta above CEC_EDGE_DELTA_MAX, an idle bus
+// between frames, is an escape record followed by two more holding the
+// 32 bit delta, low half first. A gap longer than CEC_EDGE_LONG_DELTA_MAX
+// is split into escapes repeating the current level, which decoders skip
+// as no change.
+
+#define CEC_EDGES_MAGIC 0x45434543 // "CECE"
+#define CEC_EDGES_VERSION 2
+
+#define CEC_EDGE_LEVEL 0x8000u // line released
+#define CEC_EDGE_DELTA_MAX 0x7ffeu
+#define CEC_EDGE_ESCAPE 0x7fffu // the delta is in the next two records
+#define CEC_EDGE_LONG_DELTA_MAX 0xfffffffeu
+#define CEC_EDGE_LOST 0xffffffffu // escaped delta: the capture dropped edges here, no time passes
+
+typedef struct cec_edges_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t period_us; // sampling period, the resolution of the edges
+    uint32_t idle_period_us; // sampling period before a trigger, the resolution of start bits, 0 untriggered
+    uint64_t start_ns; // CLOCK_MONOTONIC of the time the first delta counts from
+} cec_edges_header_t;
+
+static inline uint16_t cec_edge_record(int level, uint32_t delta_us) {
+    return (level ? CEC_EDGE_LEVEL : 0) | delta_us;
+}
+
+static inline int cec_edge_level(uint16_t record) {
+    return (record & CEC_EDGE_LEVEL) ? 1 : 0;
+}
+
+// Reads the edge at *index and moves past it. Returns 1 for an edge, 0 where
+// edges were lost and -1 at the end of the records, a cut off escape included.
+static inline int cec_edge_read(const uint16_t *records, size_t count, size_t *index,
+                                int *level, uint32_t *delta_us) {
+    if (*index >= count) {
+        return -1;
+    }
+
+    uint16_t record = records[(*index)++];
+    *level = cec_edge_level(record);
+    *delta_us = record & ~CEC_EDGE_LEVEL;
+    if (*delta_us != CEC_EDGE_ESCAPE) {
+        return 1;
+    }
+
+    if (count - *index < 2) {
+        *index = count;
+        return -1;
+    }
+    *delta_us = records[*index] | (uint32_t) records[*index + 1] << 16;
+    *index += 2;
+    return *delta_us == CEC_EDGE_LOST ? 0 : 1;
+}
+
+#endif // __SUNXI_HDMI_CEC_EDGES_H__
@@ -0,0 +1,299 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#define LOG_TAG "sunxi-hdmi-cec-fake"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <memory.h>
+#include <errno.h>
+#include "log.h"
+#include "config.h"
+#include "sunxi_hdmi_cec_fake.h"
+#include "sunxi_hdmi_cec_transport.h"
+
+#define FAKE_RX_QUEUE_SIZE 256
+#define FAKE_DEFAULT_PHYSICAL_ADDRESS 0x1000
+#define FAKE_DEFAULT_PRESENT (1 << 0) // the TV
+
+// Emulates the sunxi driver: one hdmi_cec_event_t per read, a blocking
+// write per frame, EBUSY when arbitration is lost and EIO on NACK.
+// The eventfd is a semaphore, so it stays readable while events are queued.
+// Events are timestamped when injected, like the kernel CEC framework does.
+// Unlike the driver it keeps every logical address it is given, so the
+// multiple address path of the HAL can be run too.
+static struct {
+    pthread_mutex_t lock;
+    int event_fd;
+    hdmi_cec_event_t rx[FAKE_RX_QUEUE_SIZE];
+    int64_t rx_timestamp[FAKE_RX_QUEUE_SIZE];
+    unsigned int rx_head;
+    unsigned int rx_count;
+    uint16_t present;
+    uint16_t physical_address;
+    uint16_t logical_addresses;
+    int started;
+    int wakeup;
+    int busy;
+    int bit_time_us;
+    sunxi_hdmi_cec_fake_tx_hook_t tx_hook;
+    void *tx_hook_arg;
+    sunxi_hdmi_cec_fake_stats_t stats;
+} fake = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .event_fd = -1,
+    .present = FAKE_DEFAULT_PRESENT,
+    .physical_address = FAKE_DEFAULT_PHYSICAL_ADDRESS,
+};
+
+static int64_t fake_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int push_event(const hdmi_cec_event_t *event) {
+    int64_t timestamp = fake_monotonic_ns();
+
+    pthread_mutex_lock(&fake.lock);
+    if (fake.rx_count >= FAKE_RX_QUEUE_SIZE) {
+        fake.stats.rx_dropped++;
+        pthread_mutex_unlock(&fake.lock);
+        return -ENOSPC;
+    }
+    unsigned int index = (fake.rx_head + fake.rx_count) % FAKE_RX_QUEUE_SIZE;
+    fake.rx[index] = *event;
+    fake.rx_timestamp[index] = timestamp;
+    fake.rx_count++;
+    fake.stats.rx_injected++;
+    int event_fd = fake.event_fd;
+    pthread_mutex_unlock(&fake.lock);
+
+    uint64_t value = 1;
+    if (event_fd >= 0 && write(event_fd, &value, sizeof(value)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int sunxi_hdmi_cec_fake_inject_frame(const unsigned char *frame, size_t length) {
+    if (length < 1 || length > sizeof(((hdmi_cec_event_t *) 0)->msg)) {
+        return -EINVAL;
+    }
+
+    hdmi_cec_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_type = MESSAGE_TYPE_RECEIVE_SUCCESS;
+    event.msg_len = length;
+    memcpy(event.msg, frame, length);
+    return push_event(&event);
+}
+
+int sunxi_hdmi_cec_fake_inject_hotplug(int connected, uint16_t physical_address) {
+    pthread_mutex_lock(&fake.lock);
+    fake.physical_address = connected ? physical_address : 0xffff;
+    pthread_mutex_unlock(&fake.lock);
+
+    hdmi_cec_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_type = connected ? MESSAGE_TYPE_CONNECTED : MESSAGE_TYPE_DISCONNECTED;
+    return push_event(&event);
+}
+
+int sunxi_hdmi_cec_fake_inject_event(int event_type, const unsigned char *msg, size_t length) {
+    if (length > sizeof(((hdmi_cec_event_t *) 0)->msg)) {
+        return -EINVAL;
+    }
+
+    hdmi_cec_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_type = event_type;
+    event.msg_len = length;
+    memcpy(event.msg, msg, length);
+    return push_event(&event);
+}
+
+void sunxi_hdmi_cec_fake_set_present(uint16_t mask) {
+    pthread_mutex_lock(&fake.lock);
+    fake.present = mask;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void sunxi_hdmi_cec_fake_set_busy(int count) {
+    pthread_mutex_lock(&fake.lock);
+    fake.busy = count;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void sunxi_hdmi_cec_fake_set_bit_time(int bit_time_us) {
+    pthread_mutex_lock(&fake.lock);
+    fake.bit_time_us = bit_time_us;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void sunxi_hdmi_cec_fake_set_tx_hook(sunxi_hdmi_cec_fake_tx_hook_t hook, void *arg) {
+    pthread_mutex_lock(&fake.lock);
+    fake.tx_hook = hook;
+    fake.tx_hook_arg = arg;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+void sunxi_hdmi_cec_fake_get_stats(sunxi_hdmi_cec_fake_stats_t *stats) {
+    pthread_mutex_lock(&fake.lock);
+    *stats = fake.stats;
+    pthread_mutex_unlock(&fake.lock);
+}
+
+static void sleep_bits(int bit_time_us, int bits) {
+    if (bit_time_us <= 0) {
+        return;
+    }
+    long long ns = (long long) bit_time_us * bits * 1000;
+    struct timespec ts = {ns / 1000000000LL, ns % 1000000000LL};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static int fake_open(cec_transport_t *transport) {
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (event_fd < 0) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    fake.event_fd = event_fd;
+    fake.rx_head = fake.rx_count = 0;
+    fake.present = get_config_int("fake_present", fake.present);
+    fake.physical_address = get_config_int("fake_phys_addr", fake.physical_address);
+    fake.bit_time_us = get_config_int("fake_bit_time_us", fake.bit_time_us);
+    pthread_mutex_unlock(&fake.lock);
+
+    transport->fd = event_fd;
+    ALOGI("fake_open: present=%04x physical_address=%04x bit_time_us=%d",
+          fake.present, fake.physical_address, fake.bit_time_us);
+    return 0;
+}
+
+static void fake_close(cec_transport_t *transport) {
+    pthread_mutex_lock(&fake.lock);
+    fake.event_fd = -1;
+    pthread_mutex_unlock(&fake.lock);
+
+    close(transport->fd);
+    transport->fd = -1;
+}
+
+static int fake_read_event(cec_transport_t *transport, hdmi_cec_event_t *event, int64_t *timestamp_ns) {
+    uint64_t value;
+    if (read(transport->fd, &value, sizeof(value)) < 0) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    if (fake.rx_count == 0) {
+        pthread_mutex_unlock(&fake.lock);
+        return -EAGAIN;
+    }
+    *event = fake.rx[fake.rx_head];
+    *timestamp_ns = fake.rx_timestamp[fake.rx_head];
+    fake.rx_head = (fake.rx_head + 1) % FAKE_RX_QUEUE_SIZE;
+    fake.rx_count--;
+    pthread_mutex_unlock(&fake.lock);
+    return 0;
+}
+
+static int fake_write_frame(cec_transport_t *transport, const unsigned char *frame, size_t length) {
+    int destination = frame[0] & 0x0f;
+    int result = 0;
+
+    pthread_mutex_lock(&fake.lock);
+    int bit_time_us = fake.bit_time_us;
+    if (fake.busy > 0) {
+        fake.busy--;
+        fake.stats.tx_busy++;
+        result = -EBUSY;
+    } else if (destination != 15 && !((fake.present >> destination) & 1)) {
+        fake.stats.tx_nacked++;
+        result = -EIO;
+    }
+    fake.stats.tx_frames++;
+    sunxi_hdmi_cec_fake_tx_hook_t hook = fake.tx_hook;
+    void *hook_arg = fake.tx_hook_arg;
+    pthread_mutex_unlock(&fake.lock);
+
+    // start bit is about two bit periods, every block is ten bits;
+    // lost arbitration is noticed within the header block
+    sleep_bits(bit_time_us, result == -EBUSY ? 2 + 4 : 2 + 10 * length);
+
+    if (hook) {
+        hook(frame, length, result, hook_arg);
+    }
+    return result;
+}
+
+static int fake_set_logical_address(cec_transport_t *transport, int addr) {
+    pthread_mutex_lock(&fake.lock);
+    fake.logical_addresses = addr == 15 ? 0 : fake.logical_addresses | (1 << addr);
+    pthread_mutex_unlock(&fake.lock);
+    return 0;
+}
+
+static int fake_get_physical_address(cec_transport_t *transport, uint16_t *addr) {
+    pthread_mutex_lock(&fake.lock);
+    *addr = fake.physical_address;
+    pthread_mutex_unlock(&fake.lock);
+    return 0;
+}
+
+static int fake_start(cec_transport_t *transport) {
+    fake.started = 1;
+    return 0;
+}
+
+static int fake_stop(cec_transport_t *transport) {
+    fake.started = 0;
+    return 0;
+}
+
+static int fake_set_wakeup(cec_transport_t *transport, int enabled) {
+    fake.wakeup = enabled;
+    return 0;
+}
+
+const cec_transport_ops_t fake_cec_transport_ops = {
+    .name = "fake",
+    .flags = CEC_TRANSPORT_MULTI_ADDRESS,
+    .open = fake_open,
+    .close = fake_close,
+    .read_event = fake_read_event,
+    .write_frame = fake_write_frame,
+    .set_logical_address = fake_set_logical_address,
+    .get_physical_address = fake_get_physical_address,
+    .start = fake_start,
+    .stop = fake_stop,
+    .set_wakeup = fake_set_wakeup,
+};
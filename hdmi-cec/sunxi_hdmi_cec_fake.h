@@ -0,0 +1,40 @@
+#ifndef __SUNXI_HDMI_CEC_FAKE_H__
+#define __SUNXI_HDMI_CEC_FAKE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Userspace stand-in for /dev/sunxi_hdmi_cec, selected with
+// persist.cec.transport=fake (or HDMI_CEC_TRANSPORT=fake). Tests and
+// benchmarks script it through these calls. Only the tools built with
+// SUNXI_HDMI_CEC_FAKE have it, the hdmi_cec module does not.
+
+// Called after every transmitted frame, from the thread that sent it.
+// result is 0, -EBUSY or -EIO, the hook may inject replies.
+typedef void (*sunxi_hdmi_cec_fake_tx_hook_t)(const unsigned char *frame, size_t length,
+                                              int result, void *arg);
+
+typedef struct sunxi_hdmi_cec_fake_stats {
+    unsigned int rx_injected;
+    unsigned int rx_dropped;
+    unsigned int tx_frames;
+    unsigned int tx_nacked;
+    unsigned int tx_busy;
+} sunxi_hdmi_cec_fake_stats_t;
+
+// frame includes the header block, returns -ENOSPC when the device queue is full
+int sunxi_hdmi_cec_fake_inject_frame(const unsigned char *frame, size_t length);
+int sunxi_hdmi_cec_fake_inject_hotplug(int connected, uint16_t physical_address);
+// any MESSAGE_TYPE_* event exactly as the driver would report it, for replays
+int sunxi_hdmi_cec_fake_inject_event(int event_type, const unsigned char *msg, size_t length);
+
+// logical addresses that acknowledge directed frames and polls
+void sunxi_hdmi_cec_fake_set_present(uint16_t mask);
+// the next count frames lose arbitration
+void sunxi_hdmi_cec_fake_set_busy(int count);
+// emulated CEC bit period, 0 completes transmits immediately
+void sunxi_hdmi_cec_fake_set_bit_time(int bit_time_us);
+void sunxi_hdmi_cec_fake_set_tx_hook(sunxi_hdmi_cec_fake_tx_hook_t hook, void *arg);
+void sunxi_hdmi_cec_fake_get_stats(sunxi_hdmi_cec_fake_stats_t *stats);
+
+#endif // __SUNXI_HDMI_CEC_FAKE_H__
@@ -0,0 +1,80 @@
+#ifndef __SUNXI_HDMI_CEC_OPCODES_H__
+#define __SUNXI_HDMI_CEC_OPCODES_H__
+
+// Opcode names for the offline tools, which run without <hardware/hdmi_cec.h>
+
+static inline const char *cec_opcode_name(int opcode) {
+    switch (opcode) {
+        case 0x00: return "FEATURE_ABORT";
+        case 0x04: return "IMAGE_VIEW_ON";
+        case 0x05: return "TUNER_STEP_INCREMENT";
+        case 0x06: return "TUNER_STEP_DECREMENT";
+        case 0x07: return "TUNER_DEVICE_STATUS";
+        case 0x08: return "GIVE_TUNER_DEVICE_STATUS";
+        case 0x09: return "RECORD_ON";
+        case 0x0a: return "RECORD_STATUS";
+        case 0x0b: return "RECORD_OFF";
+        case 0x0d: return "TEXT_VIEW_ON";
+        case 0x0f: return "RECORD_TV_SCREEN";
+        case 0x1a: return "GIVE_DECK_STATUS";
+        case 0x1b: return "DECK_STATUS";
+        case 0x32: return "SET_MENU_LANGUAGE";
+        case 0x33: return "CLEAR_ANALOG_TIMER";
+        case 0x34: return "SET_ANALOG_TIMER";
+        case 0x35: return "TIMER_STATUS";
+        case 0x36: return "STANDBY";
+        case 0x41: return "PLAY";
+        case 0x42: return "DECK_CONTROL";
+        case 0x43: return "TIMER_CLEARED_STATUS";
+        case 0x44: return "USER_CONTROL_PRESSED";
+        case 0x45: return "USER_CONTROL_RELEASED";
+        case 0x46: return "GIVE_OSD_NAME";
+        case 0x47: return "SET_OSD_NAME";
+        case 0x64: return "SET_OSD_STRING";
+        case 0x67: return "SET_TIMER_PROGRAM_TITLE";
+        case 0x70: return "SYSTEM_AUDIO_MODE_REQUEST";
+        case 0x71: return "GIVE_AUDIO_STATUS";
+        case 0x72: return "SET_SYSTEM_AUDIO_MODE";
+        case 0x7a: return "REPORT_AUDIO_STATUS";
+        case 0x7d: return "GIVE_SYSTEM_AUDIO_MODE_STATUS";
+        case 0x7e: return "SYSTEM_AUDIO_MODE_STATUS";
+        case 0x80: return "ROUTING_CHANGE";
+        case 0x81: return "ROUTING_INFORMATION";
+        case 0x82: return "ACTIVE_SOURCE";
+        case 0x83: return "GIVE_PHYSICAL_ADDRESS";
+        case 0x84: return "REPORT_PHYSICAL_ADDRESS";
+        case 0x85: return "REQUEST_ACTIVE_SOURCE";
+        case 0x86: return "SET_STREAM_PATH";
+        case 0x87: return "DEVICE_VENDOR_ID";
+        case 0x89: return "VENDOR_COMMAND";
+        case 0x8a: return "VENDOR_REMOTE_BUTTON_DOWN";
+        case 0x8b: return "VENDOR_REMOTE_BUTTON_UP";
+        case 0x8c: return "GIVE_DEVICE_VENDOR_ID";
+        case 0x8d: return "MENU_REQUEST";
+        case 0x8e: return "MENU_STATUS";
+        case 0x8f: return "GIVE_DEVICE_POWER_STATUS";
+        case 0x90: return "REPORT_POWER_STATUS";
+        case 0x91: return "GET_MENU_LANGUAGE";
+        case 0x92: return "SELECT_ANALOG_SERVICE";
+        case 0x93: return "SELECT_DIGITAL_SERVICE";
+        case 0x97: return "SET_DIGITAL_TIMER";
+        case 0x99: return "CLEAR_DIGITAL_TIMER";
+        case 0x9a: return "SET_AUDIO_RATE";
+        case 0x9d: return "INACTIVE_SOURCE";
+        case 0x9e: return "CEC_VERSION";
+        case 0x9f: return "GET_CEC_VERSION";
+        case 0xa0: return "VENDOR_COMMAND_WITH_ID";
+        case 0xa1: return "CLEAR_EXTERNAL_TIMER";
+        case 0xa2: return "SET_EXTERNAL_TIMER";
+        case 0xc0: return "INITIATE_ARC";
+        case 0xc1: return "REPORT_ARC_INITIATED";
+        case 0xc2: return "REPORT_ARC_TERMINATED";
+        case 0xc3: return "REQUEST_ARC_INITIATION";
+        case 0xc4: return "REQUEST_ARC_TERMINATION";
+        case 0xc5: return "TERMINATE_ARC";
+        case 0xff: return "ABORT";
+        default: return "UNKNOWN";
+    }
+}
+
+#endif // __SUNXI_HDMI_CEC_OPCODES_H__
@@ -0,0 +1,367 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Plays a capture written to persist.cec.capture_file back through the HAL
+// against the fake transport. Prints one JSON object with what the HAL did,
+// and with -o every event the framework got, so runs can be diffed.
+//
+//   hdmi_cec.replay [-s speed] [-a] [-m] [-o events-file] capture-file
+//
+// Speed 1 keeps the captured timing, 10 plays it ten times faster and 0
+// injects as fast as the HAL takes the events.
+
+#define LOG_TAG "replay"
+
+#include <hardware/hdmi_cec.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "log.h"
+#include "sunxi_hdmi_cec.h"
+#include "sunxi_hdmi_cec_capture.h"
+#include "sunxi_hdmi_cec_fake.h"
+#include "sunxi_hdmi_cec_transport.h"
+
+extern struct hw_module_t HAL_MODULE_INFO_SYM;
+
+#define DRAIN_TIMEOUT_NS 5000000000LL
+#define SETTLE_US 600000 // longer than the default hotplug debounce
+
+static FILE *events_file = NULL;
+static unsigned int cec_callbacks = 0;
+static unsigned int hotplug_callbacks = 0;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts = {deadline_ns / 1000000000LL, deadline_ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *sorted, unsigned int count, double p)
+{
+    if (count == 0) {
+        return 0;
+    }
+    unsigned int index = (unsigned int) (p * count + 0.999999);
+    if (index > 0) {
+        index--;
+    }
+    return sorted[index < count ? index : count - 1];
+}
+
+// called from the HAL dispatcher thread only
+static void callback(const hdmi_event_t *event, void *arg)
+{
+    if (event->type == HDMI_EVENT_CEC_MESSAGE) {
+        __atomic_fetch_add(&cec_callbacks, 1, __ATOMIC_RELAXED);
+        if (events_file) {
+            fprintf(events_file, "cec %x->%x", event->cec.initiator, event->cec.destination);
+            for (size_t i = 0; i < event->cec.length; i++) {
+                fprintf(events_file, " %02x", event->cec.body[i]);
+            }
+            fprintf(events_file, "\n");
+        }
+    } else if (event->type == HDMI_EVENT_HOT_PLUG) {
+        __atomic_fetch_add(&hotplug_callbacks, 1, __ATOMIC_RELAXED);
+        if (events_file) {
+            fprintf(events_file, "hotplug connected=%d\n", event->hotplug.connected);
+        }
+    }
+}
+
+static cec_capture_record_t *load_capture(const char *path, unsigned int *count)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Failed to open capture");
+        return NULL;
+    }
+
+    cec_capture_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != CEC_CAPTURE_MAGIC || header.version != CEC_CAPTURE_VERSION) {
+        fprintf(stderr, "Not a CEC capture\n");
+        fclose(file);
+        return NULL;
+    }
+    if (header.record_size != sizeof(cec_capture_record_t)) {
+        fprintf(stderr, "Unsupported record size: %u\n", header.record_size);
+        fclose(file);
+        return NULL;
+    }
+
+    cec_capture_record_t *records = NULL;
+    unsigned int size = 0;
+    *count = 0;
+    for (;;) {
+        if (*count == size) {
+            size = size ? size * 2 : 1024;
+            cec_capture_record_t *grown = realloc(records, size * sizeof(*records));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                free(records);
+                fclose(file);
+                return NULL;
+            }
+            records = grown;
+        }
+        // a capture cut short by a crash ends with a partial record
+        if (fread(&records[*count], sizeof(*records), 1, file) != 1) {
+            break;
+        }
+        (*count)++;
+    }
+    fclose(file);
+    return records;
+}
+
+static void set_addresses(hdmi_cec_device_t *dev, uint16_t mask)
+{
+    dev->clear_logical_address(dev);
+    for (int addr = 0; addr < CEC_ADDR_BROADCAST; addr++) {
+        if ((mask >> addr) & 1) {
+            dev->add_logical_address(dev, addr);
+        }
+    }
+}
+
+static int wait_for_events(unsigned int expected)
+{
+    int64_t deadline = now_ns() + DRAIN_TIMEOUT_NS;
+    while (sunxi_hdmi_cec_get_event_count() < expected) {
+        if (now_ns() > deadline) {
+            return -ETIMEDOUT;
+        }
+        usleep(100);
+    }
+    return 0;
+}
+
+static int inject(const cec_capture_record_t *record)
+{
+    int ret;
+    do {
+        switch (record->event_type) {
+        case MESSAGE_TYPE_RECEIVE_SUCCESS:
+            ret = sunxi_hdmi_cec_fake_inject_frame(record->msg, record->length);
+            break;
+        case MESSAGE_TYPE_CONNECTED:
+        case MESSAGE_TYPE_DISCONNECTED:
+            ret = sunxi_hdmi_cec_fake_inject_hotplug(record->event_type == MESSAGE_TYPE_CONNECTED,
+                                                     record->physical_address);
+            break;
+        default:
+            ret = sunxi_hdmi_cec_fake_inject_event(record->event_type, record->msg, record->length);
+            break;
+        }
+    } while (ret == -ENOSPC && sched_yield() == 0);
+    return ret;
+}
+
+static unsigned int sum_counts(unsigned int (*get)(int opcode))
+{
+    unsigned int total = 0;
+    for (int opcode = 0; opcode < 256; opcode++) {
+        total += get(opcode);
+    }
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    int dump_metrics = 0;
+    const char *events_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:amo:")) != -1) {
+        switch (opt) {
+        case 's': speed = strtod(optarg, NULL); break;
+        case 'a': setenv("HDMI_CEC_ASYNC_TX", "1", 1); break;
+        case 'm': dump_metrics = 1; break;
+        case 'o': events_path = optarg; break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        fprintf(stderr, "usage: %s [-s speed] [-a] [-m] [-o events-file] capture-file\n", argv[0]);
+        return 2;
+    }
+
+    unsigned int count = 0;
+    cec_capture_record_t *records = load_capture(argv[optind], &count);
+    if (!records) {
+        return 1;
+    }
+    if (count == 0) {
+        fprintf(stderr, "Empty capture\n");
+        free(records);
+        return 1;
+    }
+
+    if (events_path) {
+        events_file = fopen(events_path, "w");
+        if (!events_file) {
+            perror("Failed to open events file");
+            free(records);
+            return 1;
+        }
+    }
+
+    // everybody who talked is there to acknowledge the answers
+    uint16_t present = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (records[i].event_type == MESSAGE_TYPE_RECEIVE_SUCCESS && records[i].length &&
+            (records[i].msg[0] >> 4) != CEC_ADDR_BROADCAST) {
+            present |= 1 << (records[i].msg[0] >> 4);
+        }
+    }
+
+    char value[16];
+    snprintf(value, sizeof(value), "%u", records[0].physical_address);
+    setenv("HDMI_CEC_TRANSPORT", "fake", 1);
+    setenv("HDMI_CEC_FAKE_PHYS_ADDR", value, 0);
+    // without bus timing there is no bus to be quiet on, and our own
+    // discovery would add traffic the capture does not have
+    setenv("HDMI_CEC_TX_SIGNAL_FREE_TIME", "0", 0);
+    setenv("HDMI_CEC_DISCOVERY", "0", 0);
+
+    hw_module_t *module = &HAL_MODULE_INFO_SYM;
+    hdmi_cec_device_t *dev = NULL;
+    int err = module->methods->open(module, HDMI_CEC_HARDWARE_INTERFACE, (hw_device_t **) &dev);
+    if (err != 0) {
+        ALOGE("Error opening hardware module: %d", err);
+        free(records);
+        return 1;
+    }
+
+    sunxi_hdmi_cec_fake_set_present(present);
+    dev->set_option(dev, HDMI_OPTION_SYSTEM_CEC_CONTROL, 1);
+    dev->register_event_callback(dev, callback, dev);
+
+    uint16_t mask = records[0].logical_address_mask;
+    set_addresses(dev, mask);
+
+    int64_t *lag = calloc(count, sizeof(int64_t));
+    unsigned int injected = 0, skipped = 0;
+    int failed = 0;
+    int64_t start = now_ns();
+
+    for (unsigned int i = 0; i < count; i++) {
+        const cec_capture_record_t *record = &records[i];
+
+        // the framework changed our addresses here, everything before saw the old ones
+        if (record->logical_address_mask != mask) {
+            if (wait_for_events(injected) < 0) {
+                failed = 1;
+            }
+            mask = record->logical_address_mask;
+            set_addresses(dev, mask);
+        }
+
+        int64_t scheduled = start;
+        if (speed > 0) {
+            scheduled += (int64_t) ((record->timestamp_ns - records[0].timestamp_ns) / speed);
+            sleep_until(scheduled);
+        }
+
+        int64_t injected_ns = now_ns();
+        if (inject(record) < 0) {
+            skipped++;
+            continue;
+        }
+        lag[injected++] = (injected_ns - scheduled) / 1000;
+    }
+
+    if (wait_for_events(injected) < 0) {
+        failed = 1;
+    }
+    int64_t elapsed = now_ns() - start;
+
+    // what the dispatcher still holds, pending hotplugs and the last responses
+    usleep(SETTLE_US);
+
+    sunxi_hdmi_cec_fake_stats_t fake_stats;
+    sunxi_hdmi_cec_fake_get_stats(&fake_stats);
+    sunxi_hdmi_cec_rx_stats_t rx_stats;
+    sunxi_hdmi_cec_get_rx_stats(&rx_stats);
+
+    if (speed > 0) {
+        qsort(lag, injected, sizeof(int64_t), compare_int64);
+    } else {
+        memset(lag, 0, injected * sizeof(int64_t));
+    }
+
+    printf("{\"capture\":\"%s\",\"records\":%u,\"skipped\":%u,\"speed\":%g,"
+           "\"captured_seconds\":%.6f,\"seconds\":%.6f,\"events_per_sec\":%.1f,"
+           "\"handled\":%u,\"cec_callbacks\":%u,\"hotplug_callbacks\":%u,"
+           "\"responses\":%u,\"suppressed\":%u,\"tx_frames\":%u,\"rx_overflows\":%u,"
+           "\"lag_p50_us\":%lld,\"lag_p99_us\":%lld,\"lag_max_us\":%lld}\n",
+           argv[optind], count, skipped, speed,
+           (records[count - 1].timestamp_ns - records[0].timestamp_ns) / 1e9, elapsed / 1e9,
+           elapsed > 0 ? injected / (elapsed / 1e9) : 0.0,
+           sunxi_hdmi_cec_get_event_count(),
+           __atomic_load_n(&cec_callbacks, __ATOMIC_RELAXED),
+           __atomic_load_n(&hotplug_callbacks, __ATOMIC_RELAXED),
+           sum_counts(sunxi_hdmi_cec_get_response_count),
+           sum_counts(sunxi_hdmi_cec_get_suppressed_count),
+           fake_stats.tx_frames, rx_stats.overflows,
+           (long long) percentile(lag, injected, 0.50), (long long) percentile(lag, injected, 0.99),
+           (long long) (injected ? lag[injected - 1] : 0));
+    fflush(stdout);
+
+    if (dump_metrics) {
+        sunxi_hdmi_cec_dump_metrics(STDOUT_FILENO);
+    }
+
+    dev->common.close(&dev->common);
+    if (events_file) {
+        fclose(events_file);
+    }
+    free(lag);
+    free(records);
+    return failed;
+}
@@ -14,13 +14,47 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include "log.h"
+#include "config.h"
+#include "sunxi_hdmi_cec.h"
 
 extern struct hw_module_t HAL_MODULE_INFO_SYM;
 
 #define ME 1
 #define BRD CEC_ADDR_BROADCAST
 
+#define DEFAULT_TRACE_FILE "/data/local/tmp/hdmi_cec.trace"
+
+static volatile sig_atomic_t dump_requested;
+static volatile sig_atomic_t trace_requested;
+
+static void request_dump(int signal)
+{
+    if (signal == SIGUSR2) {
+        trace_requested = 1;
+    } else {
+        dump_requested = 1;
+    }
+}
+
+static void write_trace(void)
+{
+    char path[CONFIG_VALUE_MAX];
+    get_config_string("trace_file", path, DEFAULT_TRACE_FILE);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || sunxi_hdmi_cec_dump_trace(fd) < 0) {
+        ALOGE("failed to write trace to %s", path);
+    } else {
+        ALOGI("trace written to %s", path);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
 static int send_cec_message(hdmi_cec_device_t *dev, int initiator, int destination, const unsigned char *data,
                             size_t length) {
     cec_message_t msg;
@@ -174,7 +208,24 @@ int main(int argc, char *argv[])
     send_active_source(device, BRD);
     //send_osd_name(device, BRD);
 
-    ALOGI("initialised");
-    sleep(3600);
+    ALOGI("initialised, send SIGUSR1 to dump metrics, SIGUSR2 to write the trace");
+    signal(SIGUSR1, request_dump);
+    signal(SIGUSR2, request_dump);
+
+    time_t end = time(NULL) + 3600;
+    while (time(NULL) < end) {
+        sleep(end - time(NULL));
+        if (dump_requested) {
+            dump_requested = 0;
+            sunxi_hdmi_cec_dump_metrics(STDOUT_FILENO);
+            sunxi_hdmi_cec_dump_topology(STDOUT_FILENO);
+        }
+        if (trace_requested) {
+            trace_requested = 0;
+            write_trace();
+        }
+    }
+
+    sunxi_hdmi_cec_dump_metrics(STDOUT_FILENO);
     return 0;
 }
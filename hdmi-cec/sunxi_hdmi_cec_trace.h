@@ -0,0 +1,40 @@
+#ifndef __SUNXI_HDMI_CEC_TRACE_H__
+#define __SUNXI_HDMI_CEC_TRACE_H__
+
+#include <stdint.h>
+
+// Binary flight recorder format, written by sunxi_hdmi_cec_dump_trace()
+// and decoded by hdmi_cec.tracedump. All fields are little endian.
+
+#define CEC_TRACE_MAGIC 0x54434543 // "CECT"
+#define CEC_TRACE_VERSION 1
+
+enum cec_trace_type {
+    CEC_TRACE_RX = 1,           // data: frame, result: unused
+    CEC_TRACE_TX_ATTEMPT = 2,   // data: frame, result: HDMI_RESULT_*
+    CEC_TRACE_TX_DONE = 3,      // data: frame, result: HDMI_RESULT_*, attempts
+    CEC_TRACE_DEVICE_EVENT = 4, // data: empty, result: driver event type
+    CEC_TRACE_RX_DROP = 5,      // data: frame, dispatcher ring was full
+    CEC_TRACE_RESPONSE = 6,     // data: frame answered by the HAL
+    CEC_TRACE_RX_SUPPRESSED = 7, // data: frame, repeat within its dedup window
+};
+
+typedef struct cec_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t dropped;
+} cec_trace_header_t;
+
+typedef struct cec_trace_record {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+    uint32_t sequence;
+    uint8_t type;
+    uint8_t result;
+    uint8_t attempts;
+    uint8_t length;
+    uint8_t data[24];
+} cec_trace_record_t;
+
+#endif // __SUNXI_HDMI_CEC_TRACE_H__
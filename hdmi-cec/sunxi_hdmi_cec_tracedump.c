@@ -0,0 +1,135 @@
+// The MIT License (MIT)
+// Copyright (c) 2016 Kamil Trzciński <ayufan@ayufan.eu>
+
+// Permission is hereby granted, free of charge,
+// to any person obtaining a copy of this software
+// and associated documentation files (the "Software"),
+// to deal in the Software without restriction,
+// including without limitation the rights to
+// use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software,
+// and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice
+// shall be included in all copies or substantial portions
+// of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+// TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+// WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Offline decoder for the flight recorder written by sunxi_hdmi_cec_dump_trace()
+//
+//   hdmi_cec.tracedump [trace-file]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "sunxi_hdmi_cec_trace.h"
+#include "sunxi_hdmi_cec_opcodes.h"
+
+static const char *trace_type_name(int type) {
+    switch (type) {
+        case CEC_TRACE_RX: return "RX";
+        case CEC_TRACE_TX_ATTEMPT: return "TX_ATTEMPT";
+        case CEC_TRACE_TX_DONE: return "TX_DONE";
+        case CEC_TRACE_DEVICE_EVENT: return "EVENT";
+        case CEC_TRACE_RX_DROP: return "RX_DROP";
+        case CEC_TRACE_RESPONSE: return "RESPONSE";
+        case CEC_TRACE_RX_SUPPRESSED: return "RX_DUP";
+        default: return "?";
+    }
+}
+
+static const char *result_name(int result) {
+    switch (result) {
+        case 0: return "SUCCESS";
+        case 1: return "NACK";
+        case 2: return "BUSY";
+        case 3: return "FAIL";
+        default: return "?";
+    }
+}
+
+static void print_record(const cec_trace_record_t *record, uint64_t start_ns, uint64_t previous_ns) {
+    unsigned long long ts_us = (record->timestamp_ns - start_ns) / 1000;
+
+    printf("%8u %6llu.%06llu %+-9lld %-10s", record->sequence,
+           ts_us / 1000000, ts_us % 1000000,
+           (long long) (record->timestamp_ns - previous_ns) / 1000,
+           trace_type_name(record->type));
+
+    if (record->type == CEC_TRACE_DEVICE_EVENT) {
+        printf(" type=%d\n", record->result);
+        return;
+    }
+
+    if (record->length >= 1) {
+        printf(" %x->%x", record->data[0] >> 4, record->data[0] & 0x0f);
+    }
+    if (record->length >= 2) {
+        printf(" %-26s", cec_opcode_name(record->data[1]));
+    } else if (record->length == 1) {
+        printf(" %-26s", "POLL");
+    }
+
+    for (int i = 0; i < record->length; i++) {
+        printf(" %02x", record->data[i]);
+    }
+
+    if (record->type == CEC_TRACE_TX_ATTEMPT) {
+        printf(" result=%s", result_name(record->result));
+    } else if (record->type == CEC_TRACE_TX_DONE) {
+        printf(" result=%s attempts=%d", result_name(record->result), record->attempts);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *file = stdin;
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        file = fopen(argv[1], "rb");
+        if (!file) {
+            perror("Failed to open trace");
+            return 1;
+        }
+    }
+
+    cec_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != CEC_TRACE_MAGIC || header.version != CEC_TRACE_VERSION) {
+        fprintf(stderr, "Not a CEC trace\n");
+        return 1;
+    }
+    if (header.record_size != sizeof(cec_trace_record_t)) {
+        fprintf(stderr, "Unsupported record size: %u\n", header.record_size);
+        return 1;
+    }
+
+    printf("# records=%u overwritten=%u\n", header.count, header.dropped);
+
+    uint64_t start_ns = 0, previous_ns = 0;
+    cec_trace_record_t record;
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (fread(&record, sizeof(record), 1, file) != 1) {
+            fprintf(stderr, "Truncated trace at record %u\n", i);
+            return 1;
+        }
+        if (i == 0) {
+            start_ns = previous_ns = record.timestamp_ns;
+        }
+        print_record(&record, start_ns, previous_ns);
+        previous_ns = record.timestamp_ns;
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    return 0;
+}
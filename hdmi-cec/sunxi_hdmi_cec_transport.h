@@ -0,0 +1,61 @@
+#ifndef __SUNXI_HDMI_CEC_TRANSPORT_H__
+#define __SUNXI_HDMI_CEC_TRANSPORT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Events as framed by /dev/sunxi_hdmi_cec, every transport produces these
+#define MESSAGE_TYPE_RECEIVE_SUCCESS            1
+#define MESSAGE_TYPE_NOACK              2
+#define MESSAGE_TYPE_DISCONNECTED               3
+#define MESSAGE_TYPE_CONNECTED          4
+#define MESSAGE_TYPE_SEND_SUCCESS               5
+
+typedef struct hdmi_cec_event {
+    int event_type;
+    int msg_len;
+    unsigned char msg[17];
+} hdmi_cec_event_t;
+
+// The device retransmits and waits for the signal free time itself,
+// the HAL retry engine is bypassed.
+#define CEC_TRANSPORT_RETRIES           (1 << 0)
+// The device acknowledges every logical address it was given,
+// set_logical_address adds one and CEC_ADDR_UNREGISTERED clears them all.
+// Otherwise it only acknowledges the last one.
+#define CEC_TRANSPORT_MULTI_ADDRESS     (1 << 1)
+
+typedef struct cec_transport cec_transport_t;
+
+// All operations return 0 or -errno.
+typedef struct cec_transport_ops {
+    const char *name;
+    int flags;
+    // sets transport->fd to a descriptor that is readable while read_event has data
+    int (*open)(cec_transport_t *transport);
+    void (*close)(cec_transport_t *transport);
+    // timestamp_ns is when the device saw the event on CLOCK_MONOTONIC, 0 if unknown.
+    // -EAGAIN: nothing to report, -ENODEV: the device is gone
+    int (*read_event)(cec_transport_t *transport, hdmi_cec_event_t *event, int64_t *timestamp_ns);
+    // frame includes the header block, -EBUSY: lost arbitration, -EIO: not acknowledged
+    int (*write_frame)(cec_transport_t *transport, const unsigned char *frame, size_t length);
+    int (*set_logical_address)(cec_transport_t *transport, int addr);
+    int (*get_physical_address)(cec_transport_t *transport, uint16_t *addr);
+    int (*start)(cec_transport_t *transport);
+    int (*stop)(cec_transport_t *transport);
+    int (*set_wakeup)(cec_transport_t *transport, int enabled);
+} cec_transport_ops_t;
+
+struct cec_transport {
+    const cec_transport_ops_t *ops;
+    int fd;
+    void *priv;
+};
+
+extern const cec_transport_ops_t sunxi_cec_transport_ops;
+extern const cec_transport_ops_t linux_cec_transport_ops;
+#ifdef SUNXI_HDMI_CEC_FAKE
+extern const cec_transport_ops_t fake_cec_transport_ops;
+#endif // SUNXI_HDMI_CEC_FAKE
+
+#endif // __SUNXI_HDMI_CEC_TRANSPORT_H__